@@ -22,34 +22,1051 @@
   SOFTWARE.
 */
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/sched.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#define MAX_EVENTS 16
+#define SPAWN_STACK_SIZE 65536
+#define MAX_LISTEN_FDS 16
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_STRING_BUCKETS 256 /* of the table of interned strings */
+#define LOG_BUFFER_SIZE 65536
+#define LOG_IOV_COUNT 512 /* lines written at once in prefix mode (two iovecs each) */
+#define LOG_WRITE_TIMEOUT 1000 /* in ms, to wait for unbuffered output to become writable before dropping it */
+#define CGROUP_LIMITS_COUNT 5
+#define CGROUP_SIGNAL_PASSES 4 /* over cgroup.procs, to catch processes forked before the cgroup is frozen */
+#define READY_PROBE_INTERVAL 100    /* in ms */
+#define READY_PROBE_TIMEOUT 1000    /* in ms */
+#define HEALTH_PROBE_INTERVAL 10000 /* in ms, default */
+#define HEALTH_PROBE_TIMEOUT 1000   /* in ms, default */
+#define HEALTH_PROBE_RETRIES 3      /* default */
+#define TIMER_TICK 1000             /* in us */
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS) /* per level, at most 64 to fit the bitmaps */
+#define MAX_METRICS_CONNECTIONS 16
+#define MAX_CONTROL_CONNECTIONS 4
+#define CONNECTION_TIMEOUT 5000000 /* in us, for reading the request and writing the response */
+#define NOTIFY_BUFFER_SIZE 4096
+#define NOTIFY_MAX_FDS 16 /* passed along with notifications (and closed right away) */
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/* everything the child needs between spawning and exec */
+struct spawn_args {
+    char* const* argv;
+    char* const* envp;
+    int cpu;                 /* to pin the child to, -1 if none */
+    const int* listen_fds;   /* passed to the child as fds 3, 4, ... */
+    int listen_fds_count;
+    char* listen_pid;        /* value of LISTEN_PID in envp, to be filled in by the child */
+    char* watchdog_pid;      /* value of WATCHDOG_PID in envp, to be filled in by the child, NULL if none */
+    int output_fds[2];       /* write ends of the pipes to become stdout and stderr, -1 to inherit */
+    int cgroup_fd;           /* cgroup to join if not spawned into it already, -1 if none */
+    int exec_fd; /* write end of the exec notification pipe, -1 if not used */
+    int err;     /* errno of a failed exec (only seen by muinit with the vfork backend) */
+};
+
+/* kinds of file descriptors watched by the main loop */
+enum { EVENT_SIGNAL, EVENT_TIMER, EVENT_PIDFD, EVENT_EXEC, EVENT_LOG, EVENT_OUTPUT, EVENT_METRICS, EVENT_METRICS_CONNECTION, EVENT_NOTIFY, EVENT_PROBE, EVENT_CONTROL, EVENT_CONTROL_CONNECTION };
+
+enum { LOG_INHERIT, LOG_RAW, LOG_PREFIX };
+
+enum { OVERFLOW_BLOCK, OVERFLOW_DROP_OLDEST, OVERFLOW_DROP_NEWEST };
+
+enum { OUTPUT_BLOCKING, OUTPUT_NOWAIT, OUTPUT_SOCKET, OUTPUT_NONBLOCKING }; /* how buffered output is written without blocking */
+
+enum { RESTART_NEVER, RESTART_ON_FAILURE, RESTART_ALWAYS };
+
+enum { PROBE_NONE, PROBE_NOTIFY, PROBE_EXEC, PROBE_CONNECT, PROBE_HTTP, PROBE_FILE };
+
+/* command settings written to cgroup interface files */
+static const struct {
+    const char* setting;
+    const char* file;
+    const char* controller;
+} cgroup_limits[CGROUP_LIMITS_COUNT] = {
+    {"cpu-max", "cpu.max", "cpu"},          {"cpu-weight", "cpu.weight", "cpu"}, {"memory-high", "memory.high", "memory"},
+    {"memory-max", "memory.max", "memory"}, {"io-weight", "io.weight", "io"},
+};
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena_string { /* interned string, in the arena itself */
+    struct arena_string* next; /* in the same bucket */
+    char s[];
+};
+
+struct arena { /* memory for the commands of one read of the config file or of the command line, freed all at once with the last of them */
+    struct arena_block* blocks; /* current block, linked to the previous ones */
+    int users;                  /* commands referring to it */
+    struct arena_string* strings[ARENA_STRING_BUCKETS];
+};
+
+struct timer {
+    uint64_t deadline; /* absolute CLOCK_MONOTONIC time in us, 0 if not armed */
+    void (*callback)(struct timer* timer);
+    struct timer* next;   /* in the same slot of the timer wheel */
+    struct timer** pprev; /* link pointing to this timer, for unlinking in O(1) */
+    int slot;             /* in the timer wheel, level * TIMER_SLOTS + index */
+};
+
+struct probe { /* readiness or health check of a command, run without blocking the main loop */
+    const char* spec; /* as given, NULL if none */
+    int kind;
+    int id;            /* 2 * index of the command + 1 for health checks */
+    char** argv;       /* of exec probes */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char* request;     /* of HTTP probes */
+    const char* path;  /* of file probes */
+    long interval;     /* in ms */
+    long timeout;      /* in ms */
+    int retries;       /* consecutive failures making a command unhealthy */
+    int failures;      /* consecutive ones */
+    int running;
+    int fd;            /* socket of a running probe, -1 if none */
+    int connected;
+    char response[16]; /* beginning of the HTTP response */
+    int response_len;
+    pid_t pid;         /* of a (possibly abandoned) exec probe, 0 if none */
+    struct timer timer;
+};
+
+struct command {
+    char** argv;
+    int replicas;
+    int pin_cpus;        /* pin each replica to one of the CPUs muinit may run on */
+    char** listen;       /* addresses to listen on for the command */
+    int listen_count;
+    int listen_reuseport; /* separate TCP sockets with SO_REUSEPORT per replica */
+    int* listen_fds;      /* shared by the replicas, -1 for separate SO_REUSEPORT ones */
+    char** env;          /* NAME=VALUE set for the command, taking precedence over muinit's environment */
+    int env_count;
+    int restart_policy;
+    long backoff_min;    /* in ms */
+    long backoff_max;    /* in ms */
+    long max_restarts;   /* within restart_window */
+    long restart_window; /* in s */
+    const char* cgroup;  /* name of the cgroup to run in, NULL if none is needed */
+    const char* cgroup_limits[CGROUP_LIMITS_COUNT]; /* values as in cgroup_limits, NULL if not set */
+    char* cgroup_path;   /* NULL if not running in a cgroup of its own */
+    int cgroup_fd;       /* of the cgroup directory, -1 if none */
+    int* stop_signals;   /* termination steps, conf.termination_signals if not set */
+    long* stop_timeouts; /* in ms, -1 to use conf.timeout */
+    int stop_signals_count;
+    int stop_phase; /* commands are stopped in ascending order of their phase */
+    int stop_stage; /* next step of the stop signals */
+    struct timer stop_timer;
+    const char* name;        /* to refer to the command in @after, basename of argv[0] if not set */
+    const char* after;       /* comma-separated names of commands to wait for, NULL if none */
+    int* dependencies;       /* indices in conf.commands */
+    int dependencies_count;
+    int dependencies_capacity;
+    struct probe ready_probe; /* ready once spawned if not set */
+    int ready;
+    uint64_t ready_at; /* in us since muinit started */
+    long watchdog;     /* in ms, 0 if none */
+    struct probe health_probe;
+    const char* spec;  /* settings from the config file except replicas (to detect changes on reload), NULL if not from there */
+    int removed;       /* by a config reload, its instances are stopped and never started again */
+    struct command* replaced; /* by this command on a config reload, which is only started once that is not running anymore */
+    struct arena* arena;      /* it and its settings are kept in */
+};
+
+struct usage { /* resources used by reaped processes (including their reaped descendants) */
+    uint64_t user_time;   /* in us */
+    uint64_t system_time; /* in us */
+    long max_rss;         /* in KiB, of the largest process */
+    uint64_t major_faults;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+};
+
+struct cgroup_stats { /* read from cgroup v2 interface files */
+    uint64_t user_time;      /* in us */
+    uint64_t system_time;    /* in us */
+    uint64_t throttled_time; /* in us */
+    uint64_t memory_peak;    /* in bytes, 0 if not supported */
+};
+
+struct instance { /* one replica of a command */
+    struct command* command;
+    int id; /* index in conf.instances */
+    int replica;
+    char** envp;
+    int envp_owned;        /* index of the first entry of envp allocated by muinit */
+    char* listen_pid;      /* value of LISTEN_PID in envp */
+    char* watchdog_pid;    /* value of WATCHDOG_PID in envp, NULL if there is no watchdog */
+    int* listen_fds;       /* kept open across restarts, so connections queue up meanwhile */
+    pid_t pid;             /* 0 if not running */
+    uint64_t spawned_at;   /* in us since muinit started */
+    uint64_t exec_latency; /* from spawning to exec in us, 0 if not known yet */
+    int exec_fd;           /* read end of the exec notification pipe, -1 if not watched */
+    int started;           /* has been spawned at least once */
+    int restarts;          /* in total */
+    int exit_code;         /* of the last run, -1 if it has not exited yet */
+    struct usage usage;    /* of all runs */
+    int backoff_step;      /* number of restarts since the instance last ran for at least backoff_max */
+    int window_restarts;   /* restarts since window_start */
+    uint64_t window_start; /* in us since muinit started */
+    struct timer restart_timer;
+    int notified_ready; /* sent READY=1 since last spawned */
+    char* status;       /* as last sent via STATUS=, NULL if none */
+    struct timer watchdog_timer;
+    int force_restart; /* restart regardless of the restart policy, as it failed its health check */
+    int stopped;       /* via the control socket, so it is neither restarted nor causes termination when exiting */
+    int respawn;       /* spawn again once stopped (restart via the control socket) */
+    struct timer kill_timer; /* kills it if it does not stop in time */
+    struct log_stream* log_streams[2]; /* of stdout and stderr, reused across restarts so their buffers are only allocated once */
+};
+
+struct log_stream { /* output of a child captured through a pipe, lives until the pipe is closed by all writers and everything is written */
+    int id;     /* index in conf.log_streams */
+    int fd;     /* read end of the pipe, -1 once closed */
+    int out_fd; /* where to write to */
+    int output; /* index in conf.log_outputs (if buffered) */
+    char prefix[64];
+    int prefix_len;
+    char* buf; /* pending partial line (prefix mode only) */
+    size_t len;
+    char* ring; /* output waiting to be written (only if buffered) */
+    size_t ring_start;
+    size_t ring_len;
+    int blocked;      /* ring buffer full with block policy, so not reading from the pipe */
+    int pending;      /* has output in the ring buffer waiting to be written */
+    uint64_t dropped; /* bytes dropped as the ring buffer was full */
+    int kept;         /* by its instance, which frees it */
+};
+
+struct log_output { /* stdout or stderr of muinit if output is buffered */
+    int fd;
+    int pollable;             /* 0 for e.g. regular files, which are always writable */
+    int mode;                 /* OUTPUT_*, the file description is shared with others so O_NONBLOCK is only a fallback */
+    struct log_stream* owner; /* stream that wrote an incomplete line, others have to wait (prefix mode only) */
+};
+
+struct connection { /* to the metrics endpoint (HTTP) or the control socket */
+    int fd;           /* -1 if the slot is free */
+    char request[1024];
+    size_t request_len;
+    char* response;   /* NULL until the request has been read */
+    size_t response_len;
+    size_t response_sent;
+    struct timer timeout;
+};
+
+struct stats { /* exposed via the metrics endpoint */
+    uint64_t reaped;                /* children reaped in total */
+    uint64_t reaped_adopted;        /* thereof adopted ones */
+    uint64_t forwarded[NSIG];       /* signals forwarded, by number */
+    uint64_t forward_time[NSIG];    /* total time spent forwarding them in us */
+    uint64_t forward_time_max;      /* in us */
+    uint64_t stage_started;         /* start of the current termination stage in us since muinit started */
+    uint64_t* stage_durations;      /* per termination stage in us, the current one while running */
+    struct usage adopted_usage;
+};
+
+struct child {
+    pid_t pid;
+    int pidfd;                 /* -1 if pidfds are not used */
+    struct instance* instance; /* NULL for adopted children */
+};
+
+struct pids { /* processes signalled through their cgroups, sorted after each pass */
+    pid_t* pids;
+    int count;
+    int capacity;
+};
+
 static struct {
+    struct command** commands; /* allocated one by one, so that they keep their addresses */
+    int commands_count;
+    struct instance** instances;
+    int instances_count;
+    int instances_started;
+    int commands_ready;
+    int instances_executing; /* spawned but not yet exec'ed (only tracked for the startup report) */
+    int* cpus;               /* CPUs muinit may run on */
+    int cpus_count;
+    int startup_delay;      /* in ms */
+    int report;
+    int log_mode;
+    struct log_stream** log_streams; /* NULL entries are free */
+    int log_streams_count;
+    size_t log_buffer_size; /* per stream, 0 if output is not buffered */
+    int log_overflow;
+    struct log_output log_outputs[2];
+    int log_outputs_shared; /* stdout and stderr are the same file, so only conf.log_outputs[0] is used */
+    int splice_unsupported;
+    int startup_reported;
+    int restarts_pending;
+    int drop_pending; /* a command removed by a config reload might have no processes left, see drop_removed_commands */
+    uint64_t start_time;
+    struct timer* timer_wheel[TIMER_LEVELS][TIMER_SLOTS]; /* level L holds timers due in 64^L to 64^(L+1) ticks */
+    uint64_t timer_slots_used[TIMER_LEVELS];              /* bitmaps of the non-empty slots */
+    uint64_t timer_tick;                                  /* up to which timers have been run */
+    uint64_t timer_fd_tick;                               /* for which the timerfd is armed, 0 if disarmed */
+    struct timer startup_timer;
+    struct timer termination_timer;
+    struct child* children; /* direct and adopted children, kept dense */
+    int children_count;
+    int children_capacity;
+    int children_dirty; /* set when processes might have been adopted since the last resync */
+    pid_t* abandoned;   /* process groups killed along with their instance, whose members' exits are only accounted */
+    int abandoned_count;
+    int abandoned_capacity;
     char* proc_children_path;
-    int termination_stage;
-    int timeout;
+    char* cgroup_path; /* of muinit's cgroup v2, NULL if not available */
+    int clone3_unsupported;
+    int cgroup_termination; /* terminate via the cgroups of the commands */
+    int epoll_fd;
+    int signal_fd;
+    int timer_fd;
+    int use_pidfds;
+    int child_exited; /* SIGCHLD received, there might be children to reap that are not watched via a pidfd */
+    int terminating;
+    int termination_stage; /* next of the global termination steps */
+    int stop_phases;       /* commands are stopped in phases instead of all at once */
+    int stop_phase;        /* phase being stopped, INT_MAX once all are done */
+    long timeout; /* in ms, for termination steps without a timeout of their own */
     int* termination_signals;
+    long* termination_timeouts; /* in ms, -1 to use conf.timeout */
     int termination_signals_count;
+    int rc;
+    int gave_up; /* children did not terminate in time, so muinit exits without waiting for them */
     sigset_t set;
+    int metrics_fd; /* -1 if there is no metrics endpoint */
+    int notify_fd;  /* -1 if no command uses the notification socket */
+    char* notify_socket; /* NOTIFY_SOCKET=... for the children */
+    int main_pids_moved; /* number of MAINPID= notifications changing an instance's pid */
+    struct connection metrics_connections[MAX_METRICS_CONNECTIONS];
+    int control_fd;           /* -1 if there is no control socket */
+    dev_t control_dev;        /* of the control socket as bound, to only remove it if not replaced meanwhile */
+    ino_t control_ino;
+    const char* control_path; /* of the control socket */
+    struct connection control_connections[MAX_CONTROL_CONNECTIONS];
+    const char* config_path;  /* reloaded on SIGHUP, NULL if none */
+    FILE* trace;              /* timeline of the shutdown in Chrome's trace event format, NULL if none */
+    int trace_events;         /* written to the trace so far */
+    uint64_t trace_started;   /* start of termination in us since muinit started, 0 if not started */
+    int trace_stage;          /* termination stage of the open stage span, -1 if none */
+    uint64_t trace_stage_started;
+    struct stats stats;
+    struct arena* arena;       /* of the commands being read, NULL otherwise */
 } conf;
 
+static void accept_connections(int listen_fd, struct connection* connections, int max, int kind);
+static int add_child(pid_t pid, struct instance* instance);
+static struct command* add_command();
+static void add_timer(struct timer* timer, uint64_t expires);
+static void advance_stop_phase();
+static void add_usage(struct usage* usage, const struct rusage* r);
+static void* arena_alloc(struct arena* arena, size_t size);
+static void* arena_append(struct arena* arena, void* array, int count, size_t size);
+static char* arena_intern(struct arena* arena, const char* s, size_t len);
+static struct instance* create_instance(struct command* command, int replica);
+static int create_instances(int first);
+static void cancel_probe(struct probe* probe);
+static void close_log_stream(struct log_stream* stream);
+static void close_connection(struct connection* connection);
+static int compare_pids(const void* a, const void* b);
+static struct log_stream* create_log_stream(struct instance* instance, int out_fd, int* write_fd);
+static int drop_oldest_output(struct log_stream* stream, size_t count);
+static void drop_removed_commands();
 static int debug(char* args, ...);
+static int find_child(pid_t pid);
+static struct instance* find_instance(pid_t pid);
+static struct probe* find_probe(int id);
+static struct probe* find_probe_by_pid(pid_t pid);
+static void finish_probe(struct probe* probe, int ok);
+static void finish_trace(int rc);
+static int flush_log_lines(struct log_stream* stream, int eof);
+static void flush_output(int index);
+static int flush_ring(struct log_stream* stream);
+static void free_log_stream(struct log_stream* stream);
+static void free_arena(struct arena* arena);
+static void free_command(struct command* command);
+static void free_instance(struct instance* instance);
+static void freeze_cgroup(int cgroup_fd, int frozen);
+static int is_abandoned(pid_t pid);
+static int is_managed_variable(const char* s);
+static int is_same_variable(const char* a, const char* b);
+static int is_running(struct command* command);
+static void kill_instance(struct instance* instance, int sig);
+static void mark_ready(struct command* command);
+static void maybe_print_startup_report();
+static void handle_control_connection(int id);
+static void handle_exec(int index);
+static void handle_exit(pid_t pid, int child_rc, const struct rusage* r, int abandoned);
+static int handle_log(int id);
+static void handle_notify();
+static void handle_metrics_connection(int id);
+static void handle_pidfd(pid_t pid);
+static void handle_probe(int id);
+static void handle_signals();
+static void handle_timer();
+static void init_probe(struct probe* probe, int id, long interval, long timeout, int retries);
+static int is_probe(const char* s);
+static uint64_t next_timer_tick();
+static uint64_t now();
+static void on_connection_timeout(struct timer* timer);
+static void on_probe_timer(struct timer* timer);
+static void on_kill_timer(struct timer* timer);
+static void on_restart_timer(struct timer* timer);
+static void on_watchdog_timer(struct timer* timer);
+static void on_startup_timer(struct timer* timer);
+static void on_stop_timer(struct timer* timer);
+static void on_termination_timer(struct timer* timer);
+static int open_listen_socket(const char* address, int reuseport);
+static int parse_command_setting(struct command* command, const char* key, char* value);
+static int parse_config(const char* path);
+static int parse_config_text(const char* path, char* text, char* spec_buf);
+static int parse_commands(char* argv[]);
+static const char* parse_control_target(char** args, int count, struct command** command, int* replica);
+static void print_command_status(FILE* f, struct command* command, int replica, int with_instances);
+static void print_json_string(FILE* f, const char* s);
+static void print_label_value(FILE* f, const char* s);
+static void print_metrics(FILE* f);
+static void print_resource_report();
+static void print_startup_report();
 static void print_usage(const char* name, int show_full_help);
-static int read_signals_array(char* s, int* count, int** signals);
-static int register_signal_handler(int sig);
+static int put_into_ring(struct log_stream* stream, struct iovec* iov, int count);
+static int read_cgroup_stats(const char* path, struct cgroup_stats* stats);
+static int resolve_address(const char* address, int passive, struct sockaddr_storage* addr, socklen_t* addr_len);
+static int read_number_pair(const char* s, long* a, long* b);
+static int read_config(const char* path);
+static int read_signal(const char* s, char** end);
+static int read_signals(char* s, int* count, int* signals, long* timeouts);
+static int read_signals_array(char* s, int* count, int** signals, long** timeouts);
+static int reap_children();
+static void reload_config();
+static void remove_command(struct command* command);
+static void remove_child(pid_t pid);
+static int reserve_children(int count);
+static void restart_instance(struct instance* instance);
+static void run_control_command(FILE* f, char* request);
+static const char* scale_command(struct command* command, int replicas);
+static int schedule_restart(struct instance* instance, int child_rc);
+static void send_response(struct connection* connection);
+static int send_signal_to_child(struct child* child, int sig);
+static void resync_children();
+static void run_timers(uint64_t tick);
+static void set_fd_events(int fd, int kind, int id, uint32_t events);
+static void signal_cgroup(int cgroup_fd, int sig, struct pids* signalled);
+static void signal_cgroups(int sig);
+static void signal_name(char* buf, size_t size, int sig);
+static int setup_cgroups(int first);
+static int setup_dependencies();
+static int setup_notify_socket();
+static int setup_probes(int first);
 static void send_signal_to_children(int sig);
-static void signal_handler(int sig);
-static void spawn(char* const args[]);
-static int spawn_children(char* argv[]);
+static void spawn(struct instance* instance);
+static char** split_words(char* s);
+static void start_instance(struct instance* instance);
+static void start_instances();
+static void start_probe(struct probe* probe);
+static int spawn_child_main(void* arg);
+static void start_timer(struct timer* timer, uint64_t delay);
+static void stop_command(struct command* command);
+static void stop_instance(struct instance* instance);
+static void stop_timer(struct timer* timer);
 static void terminate_children();
+static void trace_event(const char* phase, const char* name, int tid, uint64_t ts, uint64_t dur, const char* args);
+static void trace_stage(int stage);
+static void unlink_timer(struct timer* timer);
+static void unwatch_fd(int fd);
+static void update_timer_fd();
+static int watch_fd(int fd, int kind, int id);
+static int write_cgroup_file(const char* path, const char* file, const char* value);
+static void write_pid(char* s);
+static void write_fully(int fd, struct iovec* iov, int count);
+static ssize_t write_output(struct log_output* out, const struct iovec* iov, int count);
+
+static void accept_connections(int listen_fd, struct connection* connections, int max, int kind) { /* of the metrics endpoint or the control socket */
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                fprintf(stderr, "accept failed: %m\n");
+            }
+            return;
+        }
+        int id = 0;
+        while (id < max && connections[id].fd >= 0) {
+            ++id;
+        }
+        if (id == max || watch_fd(fd, kind, id)) {
+            debug("dropping connection\n");
+            close(fd);
+            continue;
+        }
+        struct connection* connection = &connections[id];
+        connection->fd = fd;
+        connection->request_len = 0;
+        connection->response_len = 0;
+        connection->response_sent = 0;
+        start_timer(&connection->timeout, CONNECTION_TIMEOUT);
+    }
+}
+
+static int add_child(pid_t pid, struct instance* instance) { /* children are only added while still unreaped, so their pids can't be reused yet */
+    if (reserve_children(conf.children_count + 1)) {
+        return 1;
+    }
+    struct child* child = &conf.children[conf.children_count];
+    child->pid = pid;
+    child->pidfd = -1;
+    child->instance = instance;
+#ifdef SYS_pidfd_open
+    if (conf.use_pidfds) {
+        child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (child->pidfd < 0) {
+            if (errno == ENOSYS) {
+                debug("pidfds not supported, falling back to pids\n");
+                conf.use_pidfds = 0;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                debug("out of file descriptors, tracking %d by pid\n", pid); /* e.g. after adopting a storm of orphans */
+            } else if (errno != ESRCH) {
+                fprintf(stderr, "pidfd_open failed: %m\n");
+                return 1;
+            }
+        } else if (watch_fd(child->pidfd, EVENT_PIDFD, pid)) {
+            return 1;
+        }
+    }
+#endif
+    ++conf.children_count;
+    return 0;
+}
+
+static struct command* add_command() { /* appends a command with default settings */
+    struct command** commands = realloc(conf.commands, (conf.commands_count + 1) * sizeof(struct command*));
+    struct command* command = arena_alloc(conf.arena, sizeof(struct command));
+    if (!commands) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    conf.commands = commands;
+    commands[conf.commands_count] = command;
+    command->argv = NULL;
+    command->replicas = 1;
+    command->pin_cpus = 0;
+    command->listen = NULL;
+    command->listen_count = 0;
+    command->listen_reuseport = 0;
+    command->listen_fds = NULL;
+    command->env = NULL;
+    command->env_count = 0;
+    command->restart_policy = RESTART_NEVER;
+    command->backoff_min = 100;
+    command->backoff_max = 30000;
+    command->max_restarts = 5;
+    command->restart_window = 60;
+    command->cgroup = NULL;
+    for (int j = 0; j < CGROUP_LIMITS_COUNT; ++j) {
+        command->cgroup_limits[j] = NULL;
+    }
+    command->cgroup_path = NULL;
+    command->cgroup_fd = -1;
+    command->stop_signals = conf.termination_signals;
+    command->stop_timeouts = conf.termination_timeouts;
+    command->stop_signals_count = conf.termination_signals_count;
+    command->stop_phase = 0;
+    command->stop_stage = 0;
+    command->stop_timer.deadline = 0;
+    command->stop_timer.callback = on_stop_timer;
+    command->name = NULL;
+    command->after = NULL;
+    command->dependencies = NULL;
+    command->dependencies_count = 0;
+    command->dependencies_capacity = 0;
+    init_probe(&command->ready_probe, 2 * conf.commands_count, READY_PROBE_INTERVAL, READY_PROBE_TIMEOUT, 1);
+    command->ready = 0;
+    command->ready_at = 0;
+    command->watchdog = 0;
+    init_probe(&command->health_probe, 2 * conf.commands_count + 1, HEALTH_PROBE_INTERVAL, HEALTH_PROBE_TIMEOUT, HEALTH_PROBE_RETRIES);
+    command->spec = NULL;
+    command->removed = 0;
+    command->replaced = NULL;
+    command->arena = conf.arena;
+    ++conf.arena->users;
+    ++conf.commands_count;
+    return command;
+}
+
+static void advance_stop_phase() { /* stops the next phase once no command of the current one is running */
+    while (1) {
+        int next = INT_MAX;
+        for (int i = 0; i < conf.commands_count; ++i) {
+            struct command* command = conf.commands[i];
+            if (is_running(command)) {
+                if (command->stop_phase == conf.stop_phase) {
+                    return;
+                }
+                if (command->stop_phase > conf.stop_phase && command->stop_phase < next) {
+                    next = command->stop_phase;
+                }
+            }
+        }
+        for (int i = 0; i < conf.commands_count; ++i) {
+            if (conf.commands[i]->stop_phase == conf.stop_phase) {
+                stop_timer(&conf.commands[i]->stop_timer);
+            }
+        }
+        conf.stop_phase = next;
+        if (next == INT_MAX) {
+            debug("all phases stopped\n");
+            terminate_children(); /* whatever is left, e.g. adopted processes */
+            return;
+        }
+        debug("stopping phase %d\n", next);
+        for (int i = 0; i < conf.commands_count; ++i) {
+            if (conf.commands[i]->stop_phase == next && is_running(conf.commands[i])) {
+                stop_command(conf.commands[i]);
+            }
+        }
+    }
+}
+
+static void add_timer(struct timer* timer, uint64_t expires) { /* links an armed timer into the wheel slot for tick expires */
+    uint64_t delta = expires > conf.timer_tick ? expires - conf.timer_tick : 0;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> ((level + 1) * TIMER_SLOT_BITS)) {
+        ++level;
+    }
+    if (delta >> (TIMER_LEVELS * TIMER_SLOT_BITS)) {
+        expires = conf.timer_tick + ((uint64_t)1 << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1; /* beyond the wheel, added again once cascaded */
+    }
+    int index = (expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+    struct timer** head = &conf.timer_wheel[level][index];
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    timer->slot = level * TIMER_SLOTS + index;
+    conf.timer_slots_used[level] |= (uint64_t)1 << index;
+}
+
+static void add_usage(struct usage* usage, const struct rusage* r) {
+    usage->user_time += (uint64_t)r->ru_utime.tv_sec * 1000000 + r->ru_utime.tv_usec;
+    usage->system_time += (uint64_t)r->ru_stime.tv_sec * 1000000 + r->ru_stime.tv_usec;
+    if (r->ru_maxrss > usage->max_rss) {
+        usage->max_rss = r->ru_maxrss;
+    }
+    usage->major_faults += r->ru_majflt;
+    usage->voluntary_switches += r->ru_nvcsw;
+    usage->involuntary_switches += r->ru_nivcsw;
+}
+
+
+static void* arena_alloc(struct arena* arena, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    struct arena_block* current = arena->blocks;
+    if (!current || current->size - current->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        struct arena_block* block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        block->next = current;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        current = block;
+    }
+    void* p = current->data + current->used;
+    current->used += size;
+    return p;
+}
+
+static void* arena_append(struct arena* arena, void* array, int count, size_t size) { /* returns the array of count elements with room for one more,
+                                                                                        moved once its capacity (the next power of two) is used up */
+    if (count & (count - 1)) {
+        return array;
+    }
+    void* grown = arena_alloc(arena, (count ? 2 * count : 1) * size);
+    if (count) {
+        memcpy(grown, array, count * size);
+    }
+    return grown;
+}
+
+static char* arena_intern(struct arena* arena, const char* s, size_t len) { /* returns the arena's copy of the first len characters of s, shared by equal ones */
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+    }
+    struct arena_string** bucket = &arena->strings[hash % ARENA_STRING_BUCKETS];
+    for (struct arena_string* string = *bucket; string; string = string->next) {
+        if (strncmp(string->s, s, len) == 0 && string->s[len] == '\0') {
+            return string->s;
+        }
+    }
+    struct arena_string* string = arena_alloc(arena, sizeof(struct arena_string) + len + 1);
+    memcpy(string->s, s, len);
+    string->s[len] = '\0';
+    string->next = *bucket;
+    *bucket = string;
+    return string->s;
+}
+
+static void cancel_probe(struct probe* probe) { /* stops the probe, abandoning a running check */
+    stop_timer(&probe->timer);
+    probe->running = 0;
+    if (probe->fd >= 0) {
+        unwatch_fd(probe->fd);
+        close(probe->fd);
+        probe->fd = -1;
+    }
+    if (probe->pid) {
+        kill(probe->pid, SIGKILL); /* ignored once reaped */
+    }
+}
+
+static void close_log_stream(struct log_stream* stream) { /* called once the pipe has been closed by all writers */
+    stream->blocked = flush_log_lines(stream, 1);
+    unwatch_fd(stream->fd);
+    close(stream->fd);
+    stream->fd = -1;
+    if (stream->ring) {
+        stream->pending = 1;
+        flush_output(stream->output); /* frees the stream once everything is written */
+    } else {
+        free_log_stream(stream);
+    }
+}
+
+static int compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a;
+    pid_t y = *(const pid_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void close_connection(struct connection* connection) {
+    stop_timer(&connection->timeout);
+    close(connection->fd);
+    connection->fd = -1;
+    free(connection->response);
+    connection->response = NULL;
+}
+
+static struct log_stream* create_log_stream(struct instance* instance, int out_fd, int* write_fd) { /* returns the stream and the write end of its pipe */
+    int id = 0;
+    while (id < conf.log_streams_count && conf.log_streams[id]) {
+        ++id;
+    }
+    if (id == conf.log_streams_count) {
+        struct log_stream** streams = realloc(conf.log_streams, (id + 1) * sizeof(struct log_stream*));
+        if (!streams) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        conf.log_streams = streams;
+        ++conf.log_streams_count;
+    }
+    struct log_stream** kept = &instance->log_streams[out_fd == STDERR_FILENO];
+    struct log_stream* stream = *kept;
+    if (stream && conf.log_streams[stream->id] == stream) { /* output of the last run is still being forwarded, e.g. from a process left behind */
+        stream->kept = 0; /* freed once done */
+        stream = NULL;
+    }
+    if (stream) {
+        stream->len = 0;
+        stream->ring_start = 0;
+        stream->ring_len = 0;
+        stream->blocked = 0;
+        stream->pending = 0;
+        stream->dropped = 0;
+    } else {
+        stream = calloc(1, sizeof(struct log_stream));
+        if (!stream || (conf.log_mode == LOG_PREFIX && !(stream->buf = malloc(LOG_BUFFER_SIZE)))
+            || (conf.log_buffer_size && !(stream->ring = malloc(conf.log_buffer_size)))) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        stream->kept = 1;
+        *kept = stream;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) || fcntl(fds[0], F_SETFL, O_NONBLOCK)) { /* only our end is non-blocking */
+        fprintf(stderr, "creating pipe failed: %m\n");
+        exit(1);
+    }
+    stream->id = id;
+    stream->fd = fds[0];
+    stream->out_fd = out_fd;
+    stream->output = out_fd == STDERR_FILENO && !conf.log_outputs_shared;
+    if (watch_fd(stream->fd, EVENT_LOG, id)) {
+        exit(1);
+    }
+    conf.log_streams[id] = stream;
+    *write_fd = fds[1];
+    return stream;
+}
+
+static struct instance* create_instance(struct command* command, int replica) { /* with its environment and sockets, NULL if a socket can't be opened */
+    int* listen_fds = malloc((command->listen_count + 1) * sizeof(int));
+    if (!listen_fds) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    for (int j = 0; j < command->listen_count; ++j) {
+        listen_fds[j] = command->listen_fds[j] >= 0 ? command->listen_fds[j] : open_listen_socket(command->listen[j], 1);
+        if (listen_fds[j] < 0) {
+            while (j--) {
+                if (command->listen_fds[j] < 0) {
+                    close(listen_fds[j]);
+                }
+            }
+            free(listen_fds);
+            return NULL;
+        }
+    }
+    extern char** environ;
+    int environ_count = 0;
+    for (char** e = environ; *e; ++e) {
+        if (!is_managed_variable(*e)) {
+            ++environ_count;
+        }
+    }
+    struct instance** instances = realloc(conf.instances, (conf.instances_count + 1) * sizeof(struct instance*));
+    struct instance* instance = calloc(1, sizeof(struct instance));
+    char** envp = malloc((environ_count + command->env_count + 7) * sizeof(char*));
+    if (!instances || !instance || !envp || reserve_children(conf.instances_count + 1)) { /* so that spawning never grows the table */
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    conf.instances = instances;
+    int n = 0;
+    for (char** e = environ; *e; ++e) {
+        int overridden = is_managed_variable(*e);
+        for (int j = 0; j < command->env_count && !overridden; ++j) {
+            overridden = is_same_variable(*e, command->env[j]);
+        }
+        if (!overridden) {
+            envp[n] = *e;
+            ++n;
+        }
+    }
+    for (int j = 0; j < command->env_count; ++j) {
+        envp[n] = command->env[j];
+        ++n;
+    }
+    instance->envp_owned = n;
+    if (asprintf(&envp[n], "MUINIT_REPLICA=%d", replica) < 0) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    ++n;
+    if (command->listen_count) {
+        if (asprintf(&envp[n], "LISTEN_FDS=%d", command->listen_count) < 0
+            || asprintf(&envp[n + 1], "LISTEN_PID=%-11s", "") < 0) { /* room for the pid written by the child */
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        instance->listen_pid = envp[n + 1] + 11;
+        n += 2;
+    }
+    if (conf.notify_fd >= 0 && (command->watchdog || command->ready_probe.kind == PROBE_NOTIFY)) {
+        envp[n] = strdup(conf.notify_socket);
+        if (!envp[n]) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        ++n;
+    }
+    if (command->watchdog) {
+        if (asprintf(&envp[n], "WATCHDOG_USEC=%ld", command->watchdog * 1000) < 0
+            || asprintf(&envp[n + 1], "WATCHDOG_PID=%-11s", "") < 0) { /* room for the pid written by the child */
+            fprintf(stderr, "can't allocate memory: %m\n");
+            exit(1);
+        }
+        instance->watchdog_pid = envp[n + 1] + 13;
+        n += 2;
+    }
+    envp[n] = NULL;
+    instance->command = command;
+    instance->id = conf.instances_count;
+    instance->replica = replica;
+    instance->envp = envp;
+    instance->listen_fds = listen_fds;
+    instance->exec_fd = -1;
+    instance->exit_code = -1;
+    instance->watchdog_timer.callback = on_watchdog_timer;
+    instance->restart_timer.callback = on_restart_timer;
+    instance->kill_timer.callback = on_kill_timer;
+    conf.instances[conf.instances_count] = instance;
+    ++conf.instances_count;
+    return instance;
+}
+
+static int create_instances(int first) { /* creates the replicas of commands from first on, which share their sockets unless using SO_REUSEPORT */
+    for (int i = first; i < conf.commands_count; ++i) {
+        struct command* command = conf.commands[i];
+        if (command->removed) {
+            continue;
+        }
+        command->listen_fds = arena_alloc(command->arena, (command->listen_count + 1) * sizeof(int));
+        for (int j = 0; j < command->listen_count; ++j) {
+            command->listen_fds[j] = -1;
+        }
+        for (int j = 0; j < command->listen_count; ++j) {
+            if (!command->listen_reuseport || strncmp(command->listen[j], "tcp:", 4) != 0) {
+                /* a replaced command's socket is taken over, so connections queue up instead of being refused meanwhile */
+                struct command* replaced = command->replaced;
+                for (int k = 0; replaced && k < replaced->listen_count && command->listen_fds[j] < 0; ++k) {
+                    if (replaced->listen_fds[k] >= 0 && strcmp(replaced->listen[k], command->listen[j]) == 0) {
+                        command->listen_fds[j] = fcntl(replaced->listen_fds[k], F_DUPFD_CLOEXEC, 3);
+                    }
+                }
+                if (command->listen_fds[j] < 0) {
+                    command->listen_fds[j] = open_listen_socket(command->listen[j], 0);
+                }
+                if (command->listen_fds[j] < 0) {
+                    return 1;
+                }
+            }
+        }
+        for (int replica = 0; replica < command->replicas; ++replica) {
+            if (!create_instance(command, replica)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void drop_removed_commands() { /* frees commands removed by a config reload and their instances once none of their processes are left,
+                                        only between batches of events as ids change */
+    int dropped = 0;
+    for (int i = conf.commands_count - 1; i >= 0; --i) {
+        struct command* command = conf.commands[i];
+        int left = !command->removed || command->ready_probe.pid || command->health_probe.pid;
+        for (int j = 0; j < conf.instances_count && !left; ++j) {
+            left = conf.instances[j]->command == command && conf.instances[j]->pid;
+        }
+        for (int j = 0; j < conf.children_count && !left; ++j) {
+            left = conf.children[j].instance && conf.children[j].instance->command == command; /* e.g. a former main process */
+        }
+        if (left) {
+            continue;
+        }
+        debug("dropping %s\n", command->name);
+        int count = 0;
+        for (int j = 0; j < conf.instances_count; ++j) {
+            struct instance* instance = conf.instances[j];
+            if (instance->command != command) {
+                instance->id = count;
+                if (instance->exec_fd >= 0) {
+                    set_fd_events(instance->exec_fd, EVENT_EXEC, instance->id, EPOLLIN);
+                }
+                conf.instances[count] = instance;
+                ++count;
+                continue;
+            }
+            if (instance->exec_fd >= 0) {
+                unwatch_fd(instance->exec_fd);
+                close(instance->exec_fd);
+                --conf.instances_executing;
+            }
+            stop_timer(&instance->watchdog_timer);
+            stop_timer(&instance->kill_timer);
+            if (instance->started) {
+                --conf.instances_started;
+            }
+            free_instance(instance);
+        }
+        conf.instances_count = count;
+        for (int j = 0; j < conf.commands_count; ++j) {
+            if (conf.commands[j]->replaced == command) {
+                conf.commands[j]->replaced = command->replaced;
+            }
+        }
+        if (command->ready) {
+            --conf.commands_ready;
+        }
+        stop_timer(&command->stop_timer);
+        free_command(command);
+        --conf.commands_count;
+        for (int j = i; j < conf.commands_count; ++j) {
+            conf.commands[j] = conf.commands[j + 1];
+            conf.commands[j]->ready_probe.id = 2 * j;
+            conf.commands[j]->health_probe.id = 2 * j + 1;
+            struct probe* probes[] = {&conf.commands[j]->ready_probe, &conf.commands[j]->health_probe};
+            for (int k = 0; k < 2; ++k) {
+                if (probes[k]->fd >= 0) {
+                    set_fd_events(probes[k]->fd, EVENT_PROBE, probes[k]->id, probes[k]->connected ? EPOLLIN : EPOLLOUT);
+                }
+            }
+        }
+        dropped = 1;
+    }
+    if (dropped) {
+        setup_dependencies(); /* for the new indices, can't fail as nothing depends on removed commands */
+    }
+}
+
+static int drop_oldest_output(struct log_stream* stream, size_t count) { /* returns 1 if nothing could be dropped */
+    struct log_output* out = &conf.log_outputs[stream->output];
+    if (out->owner == stream) {
+        return 1; /* the oldest line has been written in part already */
+    }
+    if (count > stream->ring_len) {
+        count = stream->ring_len;
+    }
+    if (conf.log_mode == LOG_PREFIX) { /* drop whole lines only */
+        while (count < stream->ring_len && stream->ring[(stream->ring_start + count - 1) % conf.log_buffer_size] != '\n') {
+            ++count;
+        }
+    }
+    stream->ring_start = (stream->ring_start + count) % conf.log_buffer_size;
+    stream->ring_len -= count;
+    stream->dropped += count;
+    return 0;
+}
 
 static int debug(char* args, ...) {
 #ifdef DEBUG
@@ -64,207 +1081,3509 @@ static int debug(char* args, ...) {
 #endif
 }
 
-static void print_usage(const char* name, int show_full_help) {
-    if (show_full_help) {
-        printf(
-            "muinit -- lightweight subprocess supervisor\n"
-            "           - minimal 'init', e.g. for docker containers\n"
-            "           - forwards signals to subprocesses\n"
-            "           - reaps zombie subprocesses\n"
-            "           - gracefully terminates all subprocesses after one exited\n"
-            "\n");
-    }
-
-    printf(
-        "Usage:\n"
-        "  %s [OPTIONS] --- COMMANDS\n"
-        "\n"
-        "OPTIONS\n"
-        "  -h           show help message\n"
-        "  -k SIGNALS   signals to iterate over in subprocess termination\n"
-        "               (comma-separated list of their numbers)\n"
-        "               default: SIGTERM,SIGKILL\n"
-        "  -s SIGNALS   signals to forward to subprocesses (comma-separated numbers)\n"
-        "               default: SIGINT\n"
-        "  -t TIMEOUT   set subprocess termination stage timeout in seconds\n"
-        "               default: 2s\n",
-        name);
+static struct probe* find_probe(int id) {
+    return id % 2 ? &conf.commands[id / 2]->health_probe : &conf.commands[id / 2]->ready_probe;
+}
 
-    if (show_full_help) {
-        printf(
-            "\n"
-            "COMMANDS\n"
-            "     Subprocesses to be spawned and their arguments are given after the\n"
-            "     first '---' and are separated by '---' (do not include quotation marks).\n"
-            "     Though muinit emulates an init session, try not to have subprocesses go\n"
-            "     into background ('daemonize') if possible.\n"
-            "\n"
-            "SIGNAL FORWARDING\n"
-            "     Signals given via the `-s' option (and that can be caught) are forwarded\n"
-            "     to subprocesses. Special cases are SIGALRM, which is used by muinit itself,\n"
-            "     and SIGTERM, which resets the termination steps and is then forwarded.\n"
-            "     The SIGNALS option values must be lists of comma-separated numbers of the\n"
-            "     signals (run `kill -L' to see a list)\n"
-            "\n"
-            "SUBPROCESS TERMINATION\n"
-            "     Once a subprocess terminates (failing or successfully), muinit tries to\n"
-            "     gracefully terminate the other subprocesses. This is done in several\n"
-            "     successive steps until all children have terminated. The steps are defined\n"
-            "     by the signal send in each respective step as given via the `-k' option\n"
-            "     (default: SIGTERM,SIGKILL). The timeout to wait after each step before\n"
-            "     trying the next one can be given via the `-t' option (default: 2s)\n"
-            "\n"
-            "EXIT STATUS\n"
-            "    Internal errors cause an exit status of 1. Otherwise the exit status equals\n"
-            "    that of the first failed subprocess or 0 if all subprocesses succeed.\n");
+static struct probe* find_probe_by_pid(pid_t pid) { /* the exec probe running as the given process, if any */
+    for (int j = 0; j < 2 * conf.commands_count; ++j) {
+        struct probe* probe = find_probe(j);
+        if (probe->pid == pid) {
+            return probe;
+        }
     }
+    return NULL;
 }
 
-static int read_signals_array(char* s, int* count, int** signals) { /* reads a comma-separated list of signal numbers from string */
-    if (!s || s[0] == '\0') {
-        fprintf(stderr, "no signals given\n");
-        return 1;
+static void finish_probe(struct probe* probe, int ok) { /* handles the result of a check and schedules the next one */
+    struct command* command = conf.commands[probe->id / 2];
+    cancel_probe(probe);
+    if (conf.terminating || command->removed) {
+        return;
     }
-    long val;
-    char* buf = s;
-    char* next = buf;
-    while (next[0] != '\0') {
-        val = strtol(buf, &next, 10);
-        if (next == buf || (next[0] != ',' && next[0] != '\0')) {
-            fprintf(stderr, "unexpected value in %s\n", s);
-            return 1;
+    if (probe == &command->ready_probe) {
+        if (ok) {
+            mark_ready(command);
+        } else {
+            start_timer(&probe->timer, (uint64_t)probe->interval * 1000);
         }
-        if (val < 0 || val > SIGRTMAX) {
-            fprintf(stderr, "invalid signal number %ld\n", val);
-            return 1;
+        return;
+    }
+    if (ok) {
+        probe->failures = 0;
+    } else if (++probe->failures >= probe->retries) {
+        fprintf(stderr, "%s failed its health check %d times in a row, restarting it\n", command->name, probe->failures);
+        probe->failures = 0;
+        for (int i = 0; i < conf.instances_count; ++i) {
+            if (conf.instances[i]->command == command && conf.instances[i]->pid) {
+                conf.instances[i]->force_restart = 1;
+                kill_instance(conf.instances[i], SIGKILL);
+            }
         }
-        ++(*count);
-        *signals = realloc(*signals, (*count) * sizeof(int));
-        if (!(*signals)) {
-            fprintf(stderr, "can't allocate memory: %m\n");
-            return 1;
+    } else {
+        debug("%s failed its health check (%d/%d)\n", command->name, probe->failures, probe->retries);
+    }
+    start_timer(&probe->timer, (uint64_t)probe->interval * 1000);
+}
+
+static int flush_log_lines(struct log_stream* stream, int eof) { /* passes on complete lines (all if eof) with prefix, returns 1 if blocked */
+    struct iovec iov[2 * LOG_IOV_COUNT + 1];
+    int count = 0;
+    int blocked = 0;
+    size_t start = 0;
+    while (start < stream->len) {
+        char* nl = memchr(stream->buf + start, '\n', stream->len - start);
+        size_t end;
+        if (nl) {
+            end = nl - stream->buf + 1;
+        } else if (eof || (start == 0 && stream->len == LOG_BUFFER_SIZE)) {
+            end = stream->len; /* incomplete line that has to go now */
+        } else {
+            break;
         }
-        (*signals)[(*count) - 1] = val;
-        if (next[0] == ',') {
-            ++next;
+        iov[count].iov_base = stream->prefix;
+        iov[count].iov_len = stream->prefix_len;
+        iov[count + 1].iov_base = stream->buf + start;
+        iov[count + 1].iov_len = end - start;
+        count += 2;
+        if (stream->buf[end - 1] != '\n') {
+            iov[count].iov_base = "\n";
+            iov[count].iov_len = 1;
+            ++count;
         }
-        buf = next;
+        if (stream->ring) {
+            blocked = put_into_ring(stream, iov, count);
+            count = 0;
+            if (blocked) {
+                break;
+            }
+        } else if (count >= 2 * LOG_IOV_COUNT - 1) {
+            write_fully(stream->out_fd, iov, count);
+            count = 0;
+        }
+        start = end;
+    }
+    if (count) {
+        write_fully(stream->out_fd, iov, count);
+    }
+    memmove(stream->buf, stream->buf + start, stream->len - start);
+    stream->len -= start;
+    return blocked;
+}
+
+static void finish_trace(int rc) { /* adds the end of the shutdown and muinit's exit, and closes the trace */
+    if (!conf.trace) {
+        return;
+    }
+    uint64_t t = now() - conf.start_time;
+    trace_stage(-1);
+    if (conf.trace_started) {
+        trace_event("X", "shutdown", 0, conf.trace_started, t - conf.trace_started, NULL);
+    }
+    char args[32];
+    snprintf(args, sizeof(args), "{\"status\":%d}", rc);
+    trace_event("i", "exit", 0, t, 0, args);
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", conf.trace);
+    if (fclose(conf.trace)) {
+        fprintf(stderr, "can't write trace: %m\n");
+    }
+    conf.trace = NULL;
+}
+
+static void flush_output(int index) { /* writes buffered output, the stream that wrote an incomplete line first */
+    struct log_output* out = &conf.log_outputs[index];
+    int blocked = out->owner && flush_ring(out->owner);
+    for (int i = 0; i < conf.log_streams_count && !blocked; ++i) {
+        struct log_stream* stream = conf.log_streams[i];
+        if (stream && stream->pending && stream->output == index) {
+            blocked = flush_ring(stream);
+        }
+    }
+    if (out->pollable) {
+        set_fd_events(out->fd, EVENT_OUTPUT, index, blocked ? EPOLLOUT : 0);
+    }
+}
+
+static int flush_ring(struct log_stream* stream) { /* returns 1 if the output would block */
+    struct log_output* out = &conf.log_outputs[stream->output];
+    size_t size = conf.log_buffer_size;
+    while (1) {
+        while (stream->ring_len) {
+            struct iovec iov[2];
+            iov[0].iov_base = stream->ring + stream->ring_start;
+            iov[0].iov_len = size - stream->ring_start < stream->ring_len ? size - stream->ring_start : stream->ring_len;
+            iov[1].iov_base = stream->ring;
+            iov[1].iov_len = stream->ring_len - iov[0].iov_len;
+            ssize_t n = write_output(out, iov, iov[1].iov_len ? 2 : 1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    return 1;
+                }
+                n = stream->ring_len; /* nowhere to write to, drop the output */
+            }
+            char last = stream->ring[(stream->ring_start + n - 1) % size];
+            stream->ring_start = (stream->ring_start + n) % size;
+            stream->ring_len -= n;
+            if (conf.log_mode == LOG_PREFIX) {
+                out->owner = last == '\n' ? NULL : stream;
+            }
+        }
+        if (!stream->blocked) {
+            break;
+        }
+        /* there is room in the ring buffer again */
+        stream->blocked = conf.log_mode == LOG_PREFIX && flush_log_lines(stream, stream->fd < 0);
+        if (!stream->blocked && stream->fd >= 0) {
+            set_fd_events(stream->fd, EVENT_LOG, stream->id, EPOLLIN);
+        }
+    }
+    stream->pending = 0;
+    if (stream->fd < 0 && !stream->len) {
+        free_log_stream(stream);
+    }
+    return 0;
+}
+
+static void free_command(struct command* command) { /* after its instances have been freed */
+    for (int j = 0; j < command->listen_count && command->listen_fds; ++j) {
+        if (command->listen_fds[j] >= 0) {
+            close(command->listen_fds[j]);
+        }
+    }
+    if (command->cgroup_fd >= 0) {
+        close(command->cgroup_fd);
+        rmdir(command->cgroup_path); /* fails if adopted processes are still in it */
+    }
+    if (--command->arena->users == 0) {
+        free_arena(command->arena); /* along with the command itself */
+    }
+}
+
+static void free_arena(struct arena* arena) {
+    while (arena->blocks) {
+        struct arena_block* block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+static void free_instance(struct instance* instance) {
+    for (int j = 0; j < instance->command->listen_count; ++j) {
+        if (instance->command->listen_fds[j] < 0 && instance->listen_fds[j] >= 0) {
+            close(instance->listen_fds[j]); /* its own SO_REUSEPORT socket */
+        }
+    }
+    for (char** e = instance->envp + instance->envp_owned; *e; ++e) {
+        free(*e);
+    }
+    free(instance->envp);
+    free(instance->listen_fds);
+    free(instance->status);
+    for (int j = 0; j < 2; ++j) {
+        struct log_stream* stream = instance->log_streams[j];
+        if (stream && conf.log_streams[stream->id] == stream) {
+            stream->kept = 0; /* freed once done */
+        } else if (stream) {
+            free(stream->ring);
+            free(stream->buf);
+            free(stream);
+        }
+    }
+    free(instance);
+}
+
+static void freeze_cgroup(int cgroup_fd, int frozen) { /* only requests it, processes become frozen asynchronously */
+    int fd = openat(cgroup_fd, "cgroup.freeze", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, frozen ? "1" : "0", 1) < 0) {
+        fprintf(stderr, "can't %s cgroup: %m\n", frozen ? "freeze" : "thaw");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void free_log_stream(struct log_stream* stream) {
+    if (stream->dropped) {
+        fprintf(stderr, "dropped %" PRIu64 " bytes of output of %.*s\n", stream->dropped, stream->prefix_len - 3, stream->prefix + 1);
+    }
+    if (stream->ring && conf.log_outputs[stream->output].owner == stream) {
+        conf.log_outputs[stream->output].owner = NULL;
+    }
+    conf.log_streams[stream->id] = NULL;
+    if (!stream->kept) {
+        free(stream->ring);
+        free(stream->buf);
+        free(stream);
+    }
+}
+
+static int find_child(pid_t pid) {
+    for (int i = 0; i < conf.children_count; ++i) {
+        if (conf.children[i].pid == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct instance* find_instance(pid_t pid) { /* of a process, which may also be a descendant of the instance's main process */
+    for (int depth = 0; pid > 1 && depth < 16; ++depth) {
+        int i = find_child(pid);
+        if (i >= 0) {
+            return conf.children[i].instance;
+        }
+        for (i = 0; i < conf.instances_count; ++i) {
+            if (conf.instances[i]->pid == pid) { /* main process set via MAINPID= */
+                return conf.instances[i];
+            }
+        }
+        char path[32];
+        char buf[512];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            return NULL;
+        }
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[n] = '\0';
+        const char* p = strrchr(buf, ')'); /* the process name might contain anything */
+        if (!p || sscanf(p + 1, " %*c %d", &pid) != 1) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static int is_abandoned(pid_t pid) { /* of an exited but not yet reaped process, forgets process groups that are gone */
+    pid_t pgid = getpgid(pid);
+    int found = 0;
+    for (int j = 0; j < conf.abandoned_count; ++j) {
+        if (conf.abandoned[j] == pgid) {
+            found = 1;
+        } else if (kill(-conf.abandoned[j], 0) && errno == ESRCH) {
+            --conf.abandoned_count;
+            conf.abandoned[j] = conf.abandoned[conf.abandoned_count];
+            --j;
+        }
+    }
+    return found;
+}
+
+static int is_probe(const char* s) {
+    return strncmp(s, "tcp:", 4) == 0 || strncmp(s, "unix:", 5) == 0 || strncmp(s, "http:", 5) == 0 || strncmp(s, "file:", 5) == 0
+           || strncmp(s, "exec:", 5) == 0;
+}
+
+static int is_running(struct command* command) {
+    for (int i = 0; i < conf.instances_count; ++i) {
+        if (conf.instances[i]->command == command && conf.instances[i]->pid) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void kill_instance(struct instance* instance, int sig) { /* signals the instance with its process group, so that only its exit counts */
+    pid_t pgid = getpgid(instance->pid);
+    if (pgid > 0 && pgid != getpgrp()) {
+        int known = 0;
+        for (int j = 0; j < conf.abandoned_count && !known; ++j) {
+            known = conf.abandoned[j] == pgid;
+        }
+        if (!known) {
+            if (conf.abandoned_count == conf.abandoned_capacity) {
+                int capacity = conf.abandoned_capacity ? 2 * conf.abandoned_capacity : 16;
+                pid_t* abandoned = realloc(conf.abandoned, capacity * sizeof(pid_t));
+                if (!abandoned) {
+                    fprintf(stderr, "can't allocate memory: %m\n");
+                    exit(1);
+                }
+                conf.abandoned = abandoned;
+                conf.abandoned_capacity = capacity;
+            }
+            conf.abandoned[conf.abandoned_count] = pgid;
+            ++conf.abandoned_count;
+        }
+        kill(-pgid, sig);
+    }
+    kill(instance->pid, sig); /* not in the group if set via MAINPID= */
+}
+
+static void mark_ready(struct command* command) {
+    if (command->ready || command->removed) {
+        return;
+    }
+    debug("%s is ready\n", command->name);
+    command->ready = 1;
+    command->ready_at = now() - conf.start_time;
+    ++conf.commands_ready;
+    cancel_probe(&command->ready_probe);
+    if (command->health_probe.kind) {
+        start_timer(&command->health_probe.timer, (uint64_t)command->health_probe.interval * 1000);
+    }
+    start_instances();
+    maybe_print_startup_report();
+}
+
+static void maybe_print_startup_report() { /* once everything has been started, exec'ed and become ready */
+    if (conf.report && !conf.startup_reported && !conf.instances_executing && conf.instances_started == conf.instances_count
+        && conf.commands_ready == conf.commands_count) {
+        print_startup_report();
+    }
+}
+
+static void init_probe(struct probe* probe, int id, long interval, long timeout, int retries) {
+    memset(probe, 0, sizeof(*probe));
+    probe->id = id;
+    probe->interval = interval;
+    probe->timeout = timeout;
+    probe->retries = retries;
+    probe->fd = -1;
+    probe->timer.callback = on_probe_timer;
+}
+
+static int is_managed_variable(const char* s) { /* environment variables set by muinit for its children */
+    return strncmp(s, "MUINIT_REPLICA=", 15) == 0 || strncmp(s, "LISTEN_FDS=", 11) == 0 || strncmp(s, "LISTEN_PID=", 11) == 0
+           || strncmp(s, "LISTEN_FDNAMES=", 15) == 0 || strncmp(s, "NOTIFY_SOCKET=", 14) == 0 || strncmp(s, "WATCHDOG_USEC=", 14) == 0
+           || strncmp(s, "WATCHDOG_PID=", 13) == 0;
+}
+
+static int is_same_variable(const char* a, const char* b) { /* compares the names of environment variables of the form NAME=VALUE */
+    size_t len = strcspn(a, "=");
+    return strncmp(a, b, len) == 0 && b[len] == '=';
+}
+
+static void handle_control_connection(int id) { /* reads a request line and then writes the response */
+    struct connection* connection = &conf.control_connections[id];
+    if (!connection->response) {
+        ssize_t n = read(connection->fd, connection->request + connection->request_len, sizeof(connection->request) - 1 - connection->request_len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            close_connection(connection);
+            return;
+        }
+        connection->request_len += n;
+        connection->request[connection->request_len] = '\0';
+        char* end = strchr(connection->request, '\n');
+        if (!end) {
+            if (connection->request_len == sizeof(connection->request) - 1) {
+                close_connection(connection); /* request too large */
+            }
+            return;
+        }
+        *end = '\0';
+        FILE* f = open_memstream(&connection->response, &connection->response_len);
+        if (!f) {
+            fprintf(stderr, "open_memstream failed: %m\n");
+            close_connection(connection);
+            return;
+        }
+        run_control_command(f, connection->request);
+        fputc('\n', f);
+        fclose(f);
+        set_fd_events(connection->fd, EVENT_CONTROL_CONNECTION, id, EPOLLOUT);
+    }
+    send_response(connection);
+}
+
+static void handle_exec(int id) { /* the exec notification pipe is closed on exec or carries the errno of a failed one */
+    struct instance* instance = conf.instances[id];
+    int err;
+    if (read(instance->exec_fd, &err, sizeof(err)) == 0) {
+        instance->exec_latency = now() - conf.start_time - instance->spawned_at;
+        debug("child %d executed after %" PRIu64 "us\n", instance->pid, instance->exec_latency);
+    }
+    unwatch_fd(instance->exec_fd);
+    close(instance->exec_fd);
+    instance->exec_fd = -1;
+    --conf.instances_executing;
+    maybe_print_startup_report();
+}
+
+static void handle_exit(pid_t pid, int child_rc, const struct rusage* r, int abandoned) { /* abandoned if in the process group of a killed instance */
+    debug("process %d exited with %d\n", pid, child_rc);
+    struct probe* probe = find_probe_by_pid(pid);
+    if (probe) {
+        probe->pid = 0;
+        remove_child(pid); /* in case it has been adopted before */
+        conf.drop_pending |= conf.commands[probe->id / 2]->removed;
+        if (probe->running) {
+            finish_probe(probe, !child_rc);
+        }
+        return;
+    }
+    int i = find_child(pid);
+    struct instance* instance = i >= 0 ? conf.children[i].instance : NULL;
+    remove_child(pid);
+    /* its children have been reparented to us, those of a spawned main process stay in its process group unless they moved on their own */
+    conf.children_dirty |= !instance || instance->pid != pid || kill(-pid, 0) == 0;
+    ++conf.stats.reaped;
+    if (!instance && conf.main_pids_moved) {
+        instance = find_instance(pid); /* main process set via MAINPID= which was not a child at that time */
+        instance = instance && instance->pid == pid ? instance : NULL;
+    }
+    if (conf.trace && conf.terminating) { /* on a track of its own, from the start of termination until reaped */
+        char args[64];
+        snprintf(args, sizeof(args), "{\"replica\":%d,\"status\":%d}", instance ? instance->replica : -1, child_rc);
+        trace_event("X", instance ? instance->command->name : "(adopted)", pid, conf.trace_started, now() - conf.start_time - conf.trace_started, args);
+    }
+    if (instance && instance->command->removed) {
+        conf.drop_pending = 1;
+    }
+    if (instance && instance->pid != pid) { /* former main process of the instance, which carries on */
+        add_usage(&instance->usage, r);
+        return;
+    }
+    if (!instance) {
+        ++conf.stats.reaped_adopted;
+        add_usage(&conf.stats.adopted_usage, r);
+        if (abandoned) {
+            return;
+        }
+    }
+    if (instance) {
+        instance->pid = 0;
+        instance->exit_code = child_rc;
+        stop_timer(&instance->watchdog_timer);
+        stop_timer(&instance->kill_timer);
+        add_usage(&instance->usage, r);
+        if (!conf.terminating && instance->stopped) {
+            if (instance->respawn) {
+                start_instance(instance);
+            } else if (instance->command->removed) {
+                start_instances(); /* its replacement might be waiting for it */
+            }
+            return;
+        }
+        if (!conf.terminating && schedule_restart(instance, child_rc)) {
+            return;
+        }
+    }
+    if (!conf.rc) {
+        conf.rc = child_rc;
+    }
+    if (!conf.terminating) {
+        terminate_children();
+        if (conf.trace) { /* the exit causing termination */
+            char args[32];
+            snprintf(args, sizeof(args), "{\"status\":%d}", child_rc);
+            trace_event("i", instance ? instance->command->name : "(adopted)", pid, conf.trace_started, 0, args);
+        }
+    } else if (instance && conf.stop_phase != INT_MAX) {
+        advance_stop_phase();
+    }
+}
+
+static int handle_log(int id) { /* forwards output of a child, returns 1 if the pipe has been closed, -1 if there was nothing to forward */
+    struct log_stream* stream = conf.log_streams[id];
+    ssize_t n = 0;
+    static char buf[LOG_BUFFER_SIZE];
+    if (stream->ring) {
+        if (conf.log_mode == LOG_RAW) {
+            size_t size = conf.log_buffer_size;
+            if (stream->ring_len == size) {
+                if (conf.log_overflow == OVERFLOW_DROP_OLDEST) {
+                    drop_oldest_output(stream, LOG_BUFFER_SIZE);
+                } else if (conf.log_overflow == OVERFLOW_BLOCK) {
+                    stream->blocked = 1;
+                }
+            }
+            if (stream->blocked) {
+                n = -1;
+                errno = EAGAIN;
+            } else if (stream->ring_len == size) {
+                n = read(stream->fd, buf, sizeof(buf));
+                if (n > 0) {
+                    stream->dropped += n;
+                }
+            } else {
+                /* read into the free part of the ring buffer */
+                size_t end = (stream->ring_start + stream->ring_len) % size;
+                struct iovec iov[2];
+                iov[0].iov_base = stream->ring + end;
+                iov[0].iov_len = (end >= stream->ring_start ? size : stream->ring_start) - end;
+                iov[1].iov_base = stream->ring;
+                iov[1].iov_len = end >= stream->ring_start ? stream->ring_start : 0;
+                n = readv(stream->fd, iov, 2);
+                if (n > 0) {
+                    stream->ring_len += n;
+                    stream->pending = 1;
+                }
+            }
+        } else {
+            n = read(stream->fd, stream->buf + stream->len, LOG_BUFFER_SIZE - stream->len);
+            if (n > 0) {
+                stream->len += n;
+                stream->blocked = flush_log_lines(stream, 0);
+            }
+        }
+        if (stream->blocked) {
+            set_fd_events(stream->fd, EVENT_LOG, id, 0);
+        }
+        if (n > 0) {
+            flush_output(stream->output);
+        }
+    } else if (conf.log_mode == LOG_RAW && !conf.splice_unsupported) {
+        /* zero-copy pass-through */
+        while ((n = splice(stream->fd, NULL, stream->out_fd, NULL, LOG_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0 && errno == EAGAIN) {
+            /* the pipe stays readable, so wait for a full output like write_fully instead of spinning */
+            struct pollfd pfd = {stream->out_fd, POLLOUT, 0};
+            if (poll(&pfd, 1, 0) > 0) {
+                break; /* nothing to read after all */
+            }
+            if (poll(&pfd, 1, LOG_WRITE_TIMEOUT) <= 0) {
+                debug("output not writable in time, dropping it\n");
+                n = read(stream->fd, buf, sizeof(buf));
+                break;
+            }
+        }
+        if (n < 0 && errno == EINVAL) {
+            debug("splice not supported for output, falling back to read/write\n");
+            conf.splice_unsupported = 1;
+        }
+    }
+    if (!stream->ring && conf.log_mode == LOG_RAW && conf.splice_unsupported) {
+        n = read(stream->fd, buf, sizeof(buf));
+        if (n > 0) {
+            struct iovec iov = {buf, n};
+            write_fully(stream->out_fd, &iov, 1);
+        }
+    } else if (!stream->ring && conf.log_mode == LOG_PREFIX) {
+        n = read(stream->fd, stream->buf + stream->len, LOG_BUFFER_SIZE - stream->len);
+        if (n > 0) {
+            stream->len += n;
+            flush_log_lines(stream, 0);
+        }
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return -1;
+    }
+    if (n <= 0) {
+        close_log_stream(stream);
+        return 1;
+    }
+    return 0;
+}
+
+static void handle_metrics_connection(int id) { /* reads the request and then writes the response */
+    struct connection* connection = &conf.metrics_connections[id];
+    if (!connection->response) {
+        ssize_t n = read(connection->fd, connection->request + connection->request_len, sizeof(connection->request) - 1 - connection->request_len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            close_connection(connection);
+            return;
+        }
+        connection->request_len += n;
+        connection->request[connection->request_len] = '\0';
+        if (!strstr(connection->request, "\r\n\r\n") && !strstr(connection->request, "\n\n")) {
+            if (connection->request_len == sizeof(connection->request) - 1) {
+                close_connection(connection); /* request too large */
+            }
+            return;
+        }
+
+        char* body = NULL;
+        size_t body_len = 0;
+        const char* status = "200 OK";
+        FILE* f = open_memstream(&body, &body_len);
+        if (!f) {
+            fprintf(stderr, "open_memstream failed: %m\n");
+            close_connection(connection);
+            return;
+        }
+        if (strncmp(connection->request, "GET ", 4) != 0) {
+            status = "405 Method Not Allowed";
+        } else if (strncmp(connection->request + 4, "/metrics ", 9) != 0 && strncmp(connection->request + 4, "/ ", 2) != 0) {
+            status = "404 Not Found";
+        } else {
+            print_metrics(f);
+        }
+        fclose(f);
+        f = open_memstream(&connection->response, &connection->response_len);
+        if (!f) {
+            fprintf(stderr, "open_memstream failed: %m\n");
+            free(body);
+            close_connection(connection);
+            return;
+        }
+        fprintf(f, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status,
+                body_len);
+        fwrite(body, 1, body_len, f);
+        fclose(f);
+        free(body);
+        set_fd_events(connection->fd, EVENT_METRICS_CONNECTION, id, EPOLLOUT);
+    }
+    send_response(connection);
+}
+
+static void handle_notify() { /* reads sd_notify-style notifications sent to the notification socket */
+    static char buf[NOTIFY_BUFFER_SIZE];
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(NOTIFY_MAX_FDS * sizeof(int))];
+    } control;
+    while (1) {
+        struct iovec iov = {buf, sizeof(buf) - 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(conf.notify_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC | MSG_TRUNC);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "recvmsg failed: %m\n");
+            }
+            return;
+        }
+        pid_t pid = 0;
+        for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+            if (c->cmsg_type == SCM_CREDENTIALS) {
+                struct ucred cred;
+                memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+                pid = cred.pid;
+            } else if (c->cmsg_type == SCM_RIGHTS) { /* e.g. FDSTORE=1, not supported */
+                int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (int i = 0; i < count; ++i) {
+                    int fd;
+                    memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                    close(fd);
+                }
+            }
+        }
+        if ((size_t)n >= sizeof(buf)) {
+            debug("ignoring oversized notification from %d\n", pid);
+            continue;
+        }
+        struct instance* instance = pid > 0 ? find_instance(pid) : NULL;
+        if (!instance || conf.terminating) {
+            debug("ignoring notification from %d\n", pid);
+            continue;
+        }
+        buf[n] = '\0';
+        for (char* line = buf; line; ) {
+            char* next = strchr(line, '\n');
+            if (next) {
+                *next = '\0';
+                ++next;
+            }
+            struct command* command = instance->command;
+            if (strcmp(line, "READY=1") == 0) {
+                if (!instance->notified_ready) {
+                    debug("%s (replica %d) notified readiness\n", command->name, instance->replica);
+                    instance->notified_ready = 1;
+                    int ready = command->ready_probe.kind == PROBE_NOTIFY;
+                    for (int i = 0; i < conf.instances_count && ready; ++i) {
+                        ready = conf.instances[i]->command != command || conf.instances[i]->notified_ready;
+                    }
+                    if (ready) {
+                        mark_ready(command);
+                    }
+                }
+            } else if (strncmp(line, "STATUS=", 7) == 0) {
+                debug("%s (replica %d) status: %s\n", command->name, instance->replica, line + 7);
+                free(instance->status);
+                instance->status = strdup(line + 7);
+            } else if (strcmp(line, "WATCHDOG=1") == 0) {
+                if (command->watchdog && instance->pid) {
+                    start_timer(&instance->watchdog_timer, (uint64_t)command->watchdog * 1000);
+                }
+            } else if (strcmp(line, "WATCHDOG=trigger") == 0) {
+                if (instance->pid) {
+                    start_timer(&instance->watchdog_timer, 0);
+                }
+            } else if (strncmp(line, "MAINPID=", 8) == 0) {
+                char* end;
+                long main_pid = strtol(line + 8, &end, 10);
+                if (end == line + 8 || *end || main_pid <= 1 || main_pid == getpid() || find_instance(main_pid) != instance) {
+                    fprintf(stderr, "%s (replica %d) sent invalid MAINPID %s\n", command->name, instance->replica, line + 8);
+                } else if (instance->pid && main_pid != instance->pid) {
+                    debug("%s (replica %d) changed its main process from %d to %ld\n", command->name, instance->replica, instance->pid, main_pid);
+                    int i = find_child(main_pid);
+                    if (i >= 0) {
+                        conf.children[i].instance = instance;
+                    }
+                    instance->pid = main_pid;
+                    ++conf.main_pids_moved;
+                }
+            }
+            line = next;
+        }
+    }
+}
+
+static void handle_pidfd(pid_t pid) { /* reaps a child as soon as its pidfd becomes readable */
+    int i = find_child(pid);
+    if (i < 0) {
+        return;
+    }
+    siginfo_t info;
+    struct rusage r;
+    info.si_pid = 0;
+    int abandoned = conf.abandoned_count && !conf.children[i].instance && is_abandoned(pid); /* while it can still be looked up */
+    /* raw syscall as only the kernel's waitid reports the rusage */
+    if (syscall(SYS_waitid, P_PIDFD, conf.children[i].pidfd, &info, WEXITED | WNOHANG, &r)) {
+        if (errno != ECHILD) { /* ECHILD: already reaped via SIGCHLD */
+            fprintf(stderr, "waitid failed: %m\n");
+        }
+        return;
+    }
+    if (info.si_pid == 0) {
+        return;
+    }
+    if (info.si_code == CLD_EXITED) {
+        handle_exit(pid, info.si_status, &r, abandoned);
+    } else {
+        handle_exit(pid, 128 + info.si_status, &r, abandoned);
+    }
+}
+
+static void handle_probe(int id) { /* continues a running tcp, unix or http probe */
+    struct probe* probe = find_probe(id);
+    if (!probe->running || probe->fd < 0) { /* cancelled after the event was fetched, e.g. by remove_command */
+        return;
+    }
+    if (!probe->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+            finish_probe(probe, 0);
+        } else if (probe->kind == PROBE_CONNECT) {
+            finish_probe(probe, 1);
+        } else {
+            probe->connected = 1;
+            size_t n = strlen(probe->request);
+            if (send(probe->fd, probe->request, n, MSG_NOSIGNAL) != (ssize_t)n) { /* small enough to fit into the socket buffer at once */
+                finish_probe(probe, 0);
+            } else {
+                set_fd_events(probe->fd, EVENT_PROBE, probe->id, EPOLLIN);
+            }
+        }
+        return;
+    }
+    ssize_t n = read(probe->fd, probe->response + probe->response_len, sizeof(probe->response) - 1 - probe->response_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        probe->response_len += n;
+        if (probe->response_len < 12) { /* not the whole status code yet */
+            return;
+        }
+    }
+    probe->response[probe->response_len] = '\0';
+    int status = 0;
+    if (sscanf(probe->response, "HTTP/%*d.%*d %d", &status) != 1) {
+        status = 0;
+    }
+    finish_probe(probe, status >= 200 && status < 400);
+}
+
+static void handle_signals() { /* drains the signalfd, signals are thus handled synchronously in the main loop */
+    struct signalfd_siginfo info[MAX_EVENTS];
+    ssize_t n;
+    while (1) {
+        n = read(conf.signal_fd, info, sizeof(info));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                fprintf(stderr, "reading signalfd failed: %m\n");
+                exit(1);
+            }
+            return;
+        }
+        for (size_t i = 0; i < n / sizeof(struct signalfd_siginfo); ++i) {
+            int sig = info[i].ssi_signo;
+            debug("received signal %d\n", sig);
+            switch (sig) {
+                case SIGCHLD:
+                    /* reaping is done in the main loop after all events are handled */
+                    conf.child_exited = 1;
+                    break;
+                case SIGTERM:
+                    conf.terminating = 0; /* start over */
+                    terminate_children();
+                    break;
+                case SIGHUP:
+                    if (conf.config_path) {
+                        reload_config();
+                        break;
+                    }
+                    send_signal_to_children(sig);
+                    break;
+                default:
+                    send_signal_to_children(sig);
+                    break;
+            }
+        }
+    }
+}
+
+static void handle_timer() { /* runs the callbacks of all expired timers */
+    uint64_t expirations;
+    if (read(conf.timer_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "reading timerfd failed: %m\n");
+            exit(1);
+        }
+        return;
+    }
+    run_timers(now() / TIMER_TICK);
+    update_timer_fd();
+}
+
+static uint64_t next_timer_tick() { /* returns the next tick timers are due or have to be cascaded at, 0 if there are none */
+    uint64_t next = 0;
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        uint64_t used = conf.timer_slots_used[level];
+        if (!used) {
+            continue;
+        }
+        int shift = level * TIMER_SLOT_BITS;
+        uint64_t current = conf.timer_tick >> shift;
+        int start = (current + 1) & (TIMER_SLOTS - 1);
+        uint64_t rotated = start ? (used >> start) | (used << (TIMER_SLOTS - start)) : used; /* bit 0 is the slot after the current one */
+        uint64_t tick = (current + 1 + __builtin_ctzll(rotated)) << shift;
+        if (!next || tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_connection_timeout(struct timer* timer) {
+    struct connection* connection = (struct connection*)((char*)timer - offsetof(struct connection, timeout));
+    debug("connection timed out\n");
+    close_connection(connection);
+}
+
+static void on_watchdog_timer(struct timer* timer) {
+    struct instance* instance = (struct instance*)((char*)timer - offsetof(struct instance, watchdog_timer));
+    if (!instance->pid) {
+        return;
+    }
+    fprintf(stderr, "%s (replica %d) watchdog timeout, killing %d\n", instance->command->name, instance->replica, instance->pid);
+    kill_instance(instance, SIGKILL);
+}
+
+static void on_probe_timer(struct timer* timer) {
+    struct probe* probe = (struct probe*)((char*)timer - offsetof(struct probe, timer));
+    struct command* command = conf.commands[probe->id / 2];
+    if (probe->running) {
+        debug("probe %s of %s timed out\n", probe->spec, command->name);
+        finish_probe(probe, 0);
+    } else if (probe == &command->health_probe && !is_running(command)) {
+        start_timer(timer, (uint64_t)probe->interval * 1000); /* nothing to check while it is being restarted */
+    } else {
+        start_probe(probe);
+    }
+}
+
+static void on_kill_timer(struct timer* timer) {
+    struct instance* instance = (struct instance*)((char*)timer - offsetof(struct instance, kill_timer));
+    if (!instance->pid) {
+        return;
+    }
+    fprintf(stderr, "%s (replica %d) did not stop in time, killing %d\n", instance->command->name, instance->replica, instance->pid);
+    kill_instance(instance, SIGKILL);
+}
+
+static void on_restart_timer(struct timer* timer) {
+    struct instance* instance = (struct instance*)((char*)timer - offsetof(struct instance, restart_timer));
+    --conf.restarts_pending;
+    ++instance->restarts;
+    spawn(instance);
+}
+
+static void on_startup_timer(struct timer* timer) {
+    (void)timer;
+    start_instances();
+}
+
+static void on_stop_timer(struct timer* timer) {
+    stop_command((struct command*)((char*)timer - offsetof(struct command, stop_timer)));
+}
+
+static void on_termination_timer(struct timer* timer) {
+    (void)timer;
+    terminate_children();
+}
+
+static int open_listen_socket(const char* address, int reuseport) { /* address is tcp:[HOST]:PORT or unix:PATH */
+    const int one = 1;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (resolve_address(address, 1, &addr, &addr_len)) {
+        return -1;
+    }
+    if (addr.ss_family == AF_UNIX) {
+        struct stat st;
+        const char* path = ((struct sockaddr_un*)&addr)->sun_path;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int in_use = probe_fd >= 0 && connect(probe_fd, (struct sockaddr*)&addr, addr_len) == 0;
+            int stale = probe_fd >= 0 && !in_use && errno == ECONNREFUSED; /* nobody listening anymore */
+            if (probe_fd >= 0) {
+                close(probe_fd);
+            }
+            if (in_use) {
+                fprintf(stderr, "can't listen on %s: in use by another process\n", address);
+                return -1;
+            }
+            if (stale) {
+                unlink(path); /* from a previous run */
+            }
+        }
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (addr.ss_family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)))
+        || (reuseport && addr.ss_family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+        || bind(fd, (struct sockaddr*)&addr, addr_len) || listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "can't listen on %s: %m\n", address);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static const char* parse_control_target(char** args, int count, struct command** command, int* replica) { /* NAME [REPLICA] of a control request, returns an error or NULL */
+    *command = NULL;
+    for (int i = 0; i < conf.commands_count && !*command; ++i) {
+        if (!conf.commands[i]->removed && strcmp(conf.commands[i]->name, args[0]) == 0) {
+            *command = conf.commands[i];
+        }
+    }
+    if (!*command) {
+        return "unknown command";
+    }
+    *replica = -1;
+    if (count > 1) {
+        char* end;
+        long n = strtol(args[1], &end, 10);
+        if (end == args[1] || *end || n < 0 || n > INT_MAX) {
+            return "invalid replica";
+        }
+        for (int i = 0; i < conf.instances_count && *replica < 0; ++i) {
+            if (conf.instances[i]->command == *command && conf.instances[i]->replica == n) {
+                *replica = n;
+            }
+        }
+        if (*replica < 0) {
+            return "unknown replica";
+        }
+    }
+    return NULL;
+}
+
+static int parse_command_setting(struct command* command, const char* key, char* value) { /* of @KEY=VALUE arguments and config files, value is kept */
+    int rc = 0;
+    if (strcmp(key, "restart") == 0) {
+        if (strcmp(value, "never") == 0) {
+            command->restart_policy = RESTART_NEVER;
+        } else if (strcmp(value, "on-failure") == 0) {
+            command->restart_policy = RESTART_ON_FAILURE;
+        } else if (strcmp(value, "always") == 0) {
+            command->restart_policy = RESTART_ALWAYS;
+        } else {
+            fprintf(stderr, "invalid restart policy %s\n", value);
+            rc = 1;
+        }
+    } else if (strcmp(key, "backoff") == 0) {
+        rc = read_number_pair(value, &command->backoff_min, &command->backoff_max);
+        if (!rc && (command->backoff_min < 1 || command->backoff_max < command->backoff_min)) {
+            fprintf(stderr, "invalid backoff %s\n", value);
+            rc = 1;
+        }
+    } else if (strcmp(key, "max-restarts") == 0) {
+        rc = read_number_pair(value, &command->max_restarts, &command->restart_window);
+    } else if (strcmp(key, "listen") == 0) {
+        if (command->listen_count == MAX_LISTEN_FDS) {
+            fprintf(stderr, "too many addresses to listen on\n");
+            rc = 1;
+        } else {
+            command->listen = arena_append(command->arena, command->listen, command->listen_count, sizeof(char*));
+            command->listen[command->listen_count] = value;
+            ++command->listen_count;
+        }
+    } else if (strcmp(key, "env") == 0) {
+        if (!strchr(value, '=') || value[0] == '=') {
+            fprintf(stderr, "invalid environment variable %s, expected NAME=VALUE\n", value);
+            rc = 1;
+        } else if (is_managed_variable(value)) {
+            fprintf(stderr, "environment variable %s is set by muinit\n", value);
+            rc = 1;
+        } else {
+            command->env = arena_append(command->arena, command->env, command->env_count, sizeof(char*));
+            command->env[command->env_count] = value;
+            ++command->env_count;
+        }
+    } else if (strcmp(key, "reuseport") == 0) {
+        if (strcmp(value, "yes") == 0) {
+            command->listen_reuseport = 1;
+        } else if (strcmp(value, "no") == 0) {
+            command->listen_reuseport = 0;
+        } else {
+            fprintf(stderr, "invalid value for reuseport %s, expected yes or no\n", value);
+            rc = 1;
+        }
+    } else if (strcmp(key, "pin-cpus") == 0) {
+        if (strcmp(value, "yes") == 0) {
+            command->pin_cpus = 1;
+        } else if (strcmp(value, "no") == 0) {
+            command->pin_cpus = 0;
+        } else {
+            fprintf(stderr, "invalid value for pin-cpus %s, expected yes or no\n", value);
+            rc = 1;
+        }
+    } else if (strcmp(key, "name") == 0) {
+        if (!value[0] || strchr(value, ',')) {
+            fprintf(stderr, "invalid command name %s\n", value);
+            rc = 1;
+        }
+        command->name = value;
+    } else if (strcmp(key, "after") == 0) {
+        command->after = value;
+    } else if (strcmp(key, "ready") == 0) {
+        if (!is_probe(value) && strcmp(value, "notify") != 0) {
+            fprintf(stderr, "invalid readiness probe %s\n", value);
+            rc = 1;
+        }
+        command->ready_probe.spec = value;
+    } else if (strcmp(key, "health") == 0) {
+        if (!is_probe(value)) {
+            fprintf(stderr, "invalid health probe %s\n", value);
+            rc = 1;
+        }
+        command->health_probe.spec = value;
+    } else if (strcmp(key, "health-interval") == 0 || strcmp(key, "health-timeout") == 0 || strcmp(key, "health-retries") == 0) {
+        char* end;
+        long n = strtol(value, &end, 10);
+        if (end == value || end[0] != '\0' || n <= 0 || n > INT_MAX) {
+            fprintf(stderr, "invalid value for %s %s\n", key, value);
+            rc = 1;
+        }
+        if (strcmp(key, "health-interval") == 0) {
+            command->health_probe.interval = n;
+        } else if (strcmp(key, "health-timeout") == 0) {
+            command->health_probe.timeout = n;
+        } else {
+            command->health_probe.retries = n;
+        }
+    } else if (strcmp(key, "watchdog") == 0) {
+        char* end;
+        command->watchdog = strtol(value, &end, 10);
+        if (end == value || end[0] != '\0' || command->watchdog <= 0) {
+            fprintf(stderr, "invalid watchdog timeout %s\n", value);
+            rc = 1;
+        }
+    } else if (strcmp(key, "stop-signals") == 0) {
+        size_t n = strlen(value) / 2 + 1; /* at least as many as given */
+        command->stop_signals = arena_alloc(command->arena, n * sizeof(int));
+        command->stop_timeouts = arena_alloc(command->arena, n * sizeof(long));
+        command->stop_signals_count = 0;
+        rc = read_signals(value, &command->stop_signals_count, command->stop_signals, command->stop_timeouts);
+        conf.stop_phases = 1;
+    } else if (strcmp(key, "stop-phase") == 0) {
+        char* end;
+        command->stop_phase = strtol(value, &end, 10);
+        if (end == value || end[0] != '\0' || command->stop_phase == INT_MIN || command->stop_phase == INT_MAX) {
+            fprintf(stderr, "invalid stop phase %s\n", value);
+            rc = 1;
+        }
+        conf.stop_phases = 1;
+    } else if (strcmp(key, "cgroup") == 0) {
+        if (!value[0] || strchr(value, '/') || value[0] == '.') {
+            fprintf(stderr, "invalid cgroup name %s\n", value);
+            rc = 1;
+        }
+        command->cgroup = value;
+    } else if (strncmp(key, "cpu-", 4) == 0 || strncmp(key, "memory-", 7) == 0 || strncmp(key, "io-", 3) == 0) {
+        int i = 0;
+        while (i < CGROUP_LIMITS_COUNT && strcmp(key, cgroup_limits[i].setting) != 0) {
+            ++i;
+        }
+        if (i == CGROUP_LIMITS_COUNT) {
+            fprintf(stderr, "unknown command setting %s\n", key);
+            rc = 1;
+        } else {
+            char* colon = strchr(value, ':');
+            if (colon && i == 0) { /* cpu.max takes "QUOTA PERIOD", value might be shared */
+                size_t offset = colon - value;
+                value = strcpy(arena_alloc(command->arena, strlen(value) + 1), value);
+                value[offset] = ' ';
+            }
+            command->cgroup_limits[i] = value; /* checked by the kernel when written */
+        }
+    } else if (strcmp(key, "replicas") == 0) {
+        if (strcmp(value, "cpus") == 0) {
+            command->replicas = conf.cpus_count;
+        } else {
+            char* end;
+            command->replicas = strtol(value, &end, 10);
+            if (end == value || end[0] != '\0' || command->replicas < 1) {
+                fprintf(stderr, "invalid number of replicas %s\n", value);
+                rc = 1;
+            }
+        }
+    } else {
+        fprintf(stderr, "unknown command setting %s\n", key);
+        rc = 1;
+    }
+    return rc;
+}
+
+static int parse_commands(char* argv[]) { /* splits the commands at the '---' separators, their settings refer to argv */
+    conf.arena = calloc(1, sizeof(struct arena)); /* only for the commands themselves */
+    if (!conf.arena) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    char** child_argv = argv;
+    for (int i = 0;; ++i) {
+        char* arg = argv[i];
+        if (!arg || (arg[0] == '-' && arg[1] == '-' && arg[2] == '-' && arg[3] == '\0')) {
+            if (child_argv != argv + i) {
+                struct command* command = add_command();
+                while (child_argv[0] && child_argv[0][0] == '@') {
+                    char* value = strchr(child_argv[0], '=');
+                    if (!value) {
+                        fprintf(stderr, "invalid command setting %s\n", child_argv[0]);
+                        exit(1);
+                    }
+                    *value = '\0';
+                    int rc = parse_command_setting(command, child_argv[0] + 1, value + 1);
+                    *value = '=';
+                    if (rc) {
+                        exit(1);
+                    }
+                    ++child_argv;
+                }
+                if (!child_argv[0]) {
+                    fprintf(stderr, "command missing after settings\n");
+                    exit(1);
+                }
+                command->argv = child_argv;
+                if (!command->name) {
+                    command->name = basename(child_argv[0]);
+                }
+            }
+            if (!arg) {
+                break;
+            }
+            argv[i] = NULL;
+            child_argv = argv + i + 1;
+        }
+    }
+    if (!conf.arena->users) {
+        free_arena(conf.arena);
+    }
+    conf.arena = NULL;
+    return conf.commands_count;
+}
+
+static void print_command_status(FILE* f, struct command* command, int replica, int with_instances) { /* as JSON, all current replicas if replica is -1 */
+    int running = 0;
+    for (int i = 0; i < conf.instances_count; ++i) {
+        running += conf.instances[i]->command == command && conf.instances[i]->pid;
+    }
+    fputs("{\"name\":", f);
+    print_json_string(f, command->name);
+    fprintf(f, ",\"replicas\":%d,\"running\":%d,\"ready\":%s", command->replicas, running, command->ready ? "true" : "false");
+    if (!with_instances) {
+        fputc('}', f);
+        return;
+    }
+    fputs(",\"instances\":[", f);
+    int first = 1;
+    uint64_t t = now() - conf.start_time;
+    for (int i = 0; i < conf.instances_count; ++i) {
+        struct instance* instance = conf.instances[i];
+        if (instance->command != command || (replica < 0 ? instance->replica >= command->replicas : instance->replica != replica)) {
+            continue;
+        }
+        const char* state = "exited";
+        if (!instance->started) {
+            state = "waiting";
+        } else if (instance->pid) {
+            state = instance->stopped ? "stopping" : "running";
+        } else if (instance->stopped) {
+            state = "stopped";
+        } else if (instance->restart_timer.deadline) {
+            state = "restarting";
+        }
+        fprintf(f, "%s{\"replica\":%d,\"state\":\"%s\",\"restarts\":%d", first ? "" : ",", instance->replica, state, instance->restarts);
+        if (instance->pid) {
+            fprintf(f, ",\"pid\":%d,\"uptime_ms\":%" PRIu64, instance->pid, (t - instance->spawned_at) / 1000);
+        }
+        if (instance->exit_code >= 0) {
+            fprintf(f, ",\"exit_code\":%d", instance->exit_code);
+        }
+        if (instance->status) {
+            fputs(",\"status\":", f);
+            print_json_string(f, instance->status);
+        }
+        fputc('}', f);
+        first = 0;
+    }
+    fputs("]}", f);
+}
+
+static void print_json_string(FILE* f, const char* s) { /* quoted and escaped */
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '\\' || *s == '"') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void print_label_value(FILE* f, const char* s) { /* escaped as required by the Prometheus text format */
+    for (; *s; ++s) {
+        if (*s == '\\' || *s == '"') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if (*s == '\n') {
+            fputs("\\n", f);
+        } else {
+            fputc(*s, f);
+        }
+    }
+}
+
+static void print_metrics(FILE* f) { /* in Prometheus text exposition format */
+    uint64_t t = now() - conf.start_time;
+    fprintf(f, "# HELP muinit_uptime_seconds Time since muinit started.\n# TYPE muinit_uptime_seconds gauge\nmuinit_uptime_seconds %.6f\n", t / 1e6);
+    fprintf(f, "# HELP muinit_children Direct and adopted children currently supervised.\n# TYPE muinit_children gauge\nmuinit_children %d\n",
+            conf.children_count);
+    fprintf(f, "# HELP muinit_reaped_total Children reaped.\n# TYPE muinit_reaped_total counter\nmuinit_reaped_total %" PRIu64 "\n", conf.stats.reaped);
+    fprintf(f, "# HELP muinit_reaped_adopted_total Adopted children reaped.\n# TYPE muinit_reaped_adopted_total counter\nmuinit_reaped_adopted_total %" PRIu64 "\n",
+            conf.stats.reaped_adopted);
+
+    fprintf(f, "# HELP muinit_signals_forwarded_total Signals forwarded to children.\n# TYPE muinit_signals_forwarded_total counter\n");
+    for (int sig = 1; sig < NSIG; ++sig) {
+        if (conf.stats.forwarded[sig]) {
+            fprintf(f, "muinit_signals_forwarded_total{signal=\"%d\"} %" PRIu64 "\n", sig, conf.stats.forwarded[sig]);
+        }
+    }
+    fprintf(f, "# HELP muinit_signal_forward_seconds Time taken to forward a signal to all children.\n# TYPE muinit_signal_forward_seconds summary\n");
+    for (int sig = 1; sig < NSIG; ++sig) {
+        if (conf.stats.forwarded[sig]) {
+            fprintf(f, "muinit_signal_forward_seconds_sum{signal=\"%d\"} %.6f\n", sig, conf.stats.forward_time[sig] / 1e6);
+            fprintf(f, "muinit_signal_forward_seconds_count{signal=\"%d\"} %" PRIu64 "\n", sig, conf.stats.forwarded[sig]);
+        }
+    }
+    fprintf(f, "# HELP muinit_signal_forward_max_seconds Longest time taken to forward a signal.\n# TYPE muinit_signal_forward_max_seconds gauge\n");
+    fprintf(f, "muinit_signal_forward_max_seconds %.6f\n", conf.stats.forward_time_max / 1e6);
+
+    fprintf(f, "# HELP muinit_termination_stage Current termination stage, 0 if not terminating.\n# TYPE muinit_termination_stage gauge\n");
+    fprintf(f, "muinit_termination_stage %d\n", conf.termination_stage);
+    fprintf(f, "# HELP muinit_termination_stage_duration_seconds Duration of the termination stages reached so far.\n");
+    fprintf(f, "# TYPE muinit_termination_stage_duration_seconds gauge\n");
+    for (int i = 0; i < conf.termination_stage; ++i) {
+        uint64_t duration = i == conf.termination_stage - 1 ? t - conf.stats.stage_started : conf.stats.stage_durations[i];
+        fprintf(f, "muinit_termination_stage_duration_seconds{stage=\"%d\",signal=\"%d\"} %.6f\n", i + 1, conf.termination_signals[i], duration / 1e6);
+    }
+
+    fprintf(f, "# HELP muinit_adopted_cpu_seconds_total CPU time used by reaped adopted children.\n# TYPE muinit_adopted_cpu_seconds_total counter\n");
+    fprintf(f, "muinit_adopted_cpu_seconds_total{mode=\"user\"} %.6f\nmuinit_adopted_cpu_seconds_total{mode=\"system\"} %.6f\n",
+            conf.stats.adopted_usage.user_time / 1e6, conf.stats.adopted_usage.system_time / 1e6);
+
+    /* muinit's cgroup (as cgroup "") and those of the commands */
+    struct cgroup_stats cgroup;
+    fprintf(f, "# HELP muinit_cgroup_cpu_seconds_total CPU time used in the cgroup.\n# TYPE muinit_cgroup_cpu_seconds_total counter\n");
+    fprintf(f, "# HELP muinit_cgroup_cpu_throttled_seconds_total Time the cgroup has been throttled.\n");
+    fprintf(f, "# TYPE muinit_cgroup_cpu_throttled_seconds_total counter\n");
+    fprintf(f, "# HELP muinit_cgroup_memory_peak_bytes Peak memory usage of the cgroup.\n# TYPE muinit_cgroup_memory_peak_bytes gauge\n");
+    for (int i = -1; i < conf.commands_count; ++i) {
+        const char* name = i < 0 ? "" : conf.commands[i]->cgroup;
+        if ((i >= 0 && conf.commands[i]->removed) || read_cgroup_stats(i < 0 ? conf.cgroup_path : conf.commands[i]->cgroup_path, &cgroup)) {
+            continue;
+        }
+        fprintf(f, "muinit_cgroup_cpu_seconds_total{cgroup=\"");
+        print_label_value(f, name);
+        fprintf(f, "\",mode=\"user\"} %.6f\nmuinit_cgroup_cpu_seconds_total{cgroup=\"", cgroup.user_time / 1e6);
+        print_label_value(f, name);
+        fprintf(f, "\",mode=\"system\"} %.6f\nmuinit_cgroup_cpu_throttled_seconds_total{cgroup=\"", cgroup.system_time / 1e6);
+        print_label_value(f, name);
+        fprintf(f, "\"} %.6f\n", cgroup.throttled_time / 1e6);
+        if (cgroup.memory_peak) {
+            fprintf(f, "muinit_cgroup_memory_peak_bytes{cgroup=\"");
+            print_label_value(f, name);
+            fprintf(f, "\"} %" PRIu64 "\n", cgroup.memory_peak);
+        }
+    }
+
+    static const struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } instance_metrics[] = {
+        {"muinit_instance_up", "gauge", "Whether the instance is running."},
+        {"muinit_instance_uptime_seconds", "gauge", "Time since the instance was last spawned."},
+        {"muinit_instance_restarts_total", "counter", "Restarts of the instance."},
+        {"muinit_instance_last_exit_code", "gauge", "Exit code of the last run (128+N if killed by signal N)."},
+        {"muinit_instance_cpu_user_seconds_total", "counter", "User CPU time of the instance's finished runs."},
+        {"muinit_instance_cpu_system_seconds_total", "counter", "System CPU time of the instance's finished runs."},
+        {"muinit_instance_max_rss_bytes", "gauge", "Largest maximum resident set size of the instance's finished runs."},
+        {"muinit_instance_major_faults_total", "counter", "Major page faults of the instance's finished runs."},
+        {"muinit_instance_voluntary_context_switches_total", "counter", "Voluntary context switches of the instance's finished runs."},
+        {"muinit_instance_involuntary_context_switches_total", "counter", "Involuntary context switches of the instance's finished runs."},
+    };
+    for (size_t m = 0; m < sizeof(instance_metrics) / sizeof(instance_metrics[0]); ++m) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", instance_metrics[m].name, instance_metrics[m].help, instance_metrics[m].name, instance_metrics[m].type);
+        for (int i = 0; i < conf.instances_count; ++i) {
+            struct instance* instance = conf.instances[i];
+            if ((m == 1 && !instance->pid) || (m >= 3 && instance->exit_code < 0)) {
+                continue;
+            }
+            fprintf(f, "%s{command=\"", instance_metrics[m].name);
+            print_label_value(f, instance->command->name);
+            fprintf(f, "\",instance=\"%d\",replica=\"%d\"} ", instance->id, instance->replica);
+            switch (m) {
+                case 0:
+                    fprintf(f, "%d\n", instance->pid != 0);
+                    break;
+                case 1:
+                    fprintf(f, "%.6f\n", (t - instance->spawned_at) / 1e6);
+                    break;
+                case 2:
+                    fprintf(f, "%d\n", instance->restarts);
+                    break;
+                case 3:
+                    fprintf(f, "%d\n", instance->exit_code);
+                    break;
+                case 4:
+                    fprintf(f, "%.6f\n", instance->usage.user_time / 1e6);
+                    break;
+                case 5:
+                    fprintf(f, "%.6f\n", instance->usage.system_time / 1e6);
+                    break;
+                case 6:
+                    fprintf(f, "%ld\n", instance->usage.max_rss * 1024);
+                    break;
+                case 7:
+                    fprintf(f, "%" PRIu64 "\n", instance->usage.major_faults);
+                    break;
+                case 8:
+                    fprintf(f, "%" PRIu64 "\n", instance->usage.voluntary_switches);
+                    break;
+                case 9:
+                    fprintf(f, "%" PRIu64 "\n", instance->usage.involuntary_switches);
+                    break;
+            }
+        }
+    }
+}
+
+static void print_resource_report() {
+    fprintf(stderr, "resource usage:\n  %7s %5s %10s %10s %13s %12s %18s  %s\n", "replica", "runs", "user (s)", "system (s)", "max rss (MiB)", "major faults",
+            "switches (vol/inv)", "command");
+    for (int i = 0; i <= conf.instances_count; ++i) {
+        struct usage* usage = i < conf.instances_count ? &conf.instances[i]->usage : &conf.stats.adopted_usage;
+        char switches[32];
+        snprintf(switches, sizeof(switches), "%" PRIu64 "/%" PRIu64, usage->voluntary_switches, usage->involuntary_switches);
+        if (i < conf.instances_count) {
+            struct instance* instance = conf.instances[i];
+            fprintf(stderr, "  %7d %5d", instance->replica, instance->restarts + (instance->exit_code >= 0));
+        } else {
+            fprintf(stderr, "  %7s %5" PRIu64, "-", conf.stats.reaped_adopted);
+        }
+        fprintf(stderr, " %10.3f %10.3f %13.1f %12" PRIu64 " %18s  %s\n", usage->user_time / 1e6, usage->system_time / 1e6, usage->max_rss / 1024., usage->major_faults,
+                switches, i < conf.instances_count ? conf.instances[i]->command->argv[0] : "(adopted)");
+    }
+    struct cgroup_stats cgroup;
+    for (int i = -1; i < conf.commands_count; ++i) {
+        const char* path = i < 0 ? conf.cgroup_path : conf.commands[i]->cgroup_path;
+        if (read_cgroup_stats(path, &cgroup)) {
+            continue;
+        }
+        fprintf(stderr, "  cgroup %s: user %.3fs, system %.3fs, throttled %.3fs", path, cgroup.user_time / 1e6, cgroup.system_time / 1e6,
+                cgroup.throttled_time / 1e6);
+        if (cgroup.memory_peak) {
+            fprintf(stderr, ", memory peak %.1fMiB", cgroup.memory_peak / 1048576.);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+static void print_startup_report() {
+    conf.startup_reported = 1;
+    fprintf(stderr, "startup report:\n  %7s %7s %12s %12s %12s  %s\n", "pid", "replica", "spawned (ms)", "exec (ms)", "ready (ms)", "command");
+    for (int i = 0; i < conf.instances_count; ++i) {
+        struct instance* instance = conf.instances[i];
+        fprintf(stderr, "  %7d %7d %12.3f %12.3f %12.3f  %s\n", instance->pid, instance->replica, instance->spawned_at / 1000., instance->exec_latency / 1000.,
+                instance->command->ready_at / 1000., instance->command->argv[0]);
+    }
+}
+
+static void print_usage(const char* name, int show_full_help) {
+    if (show_full_help) {
+        printf(
+            "muinit -- lightweight subprocess supervisor\n"
+            "           - minimal 'init', e.g. for docker containers\n"
+            "           - forwards signals to subprocesses\n"
+            "           - reaps zombie subprocesses\n"
+            "           - gracefully terminates all subprocesses after one exited\n"
+            "\n");
+    }
+
+    printf(
+        "Usage:\n"
+        "  %s [OPTIONS] [-f FILE] --- COMMANDS\n"
+        "\n"
+        "OPTIONS\n"
+        "  -b SIZE[:POLICY]\n"
+        "               buffer up to SIZE bytes (suffixes k and M allowed, at least\n"
+        "               128k) of output of each subprocess in raw and prefix mode, so\n"
+        "               subprocesses are not held up by slow stdout/stderr; if full,\n"
+        "               POLICY decides: block (stop reading until there is room again),\n"
+        "               drop-oldest or drop-newest (in prefix mode whole lines); only\n"
+        "               if stdout/stderr can't be written to without blocking otherwise\n"
+        "               (e.g. terminals, or pipes before Linux 5.8), they are made\n"
+        "               non-blocking, which affects all processes sharing them\n"
+        "               default: unbuffered\n"
+        "  -c PATH      serve a control socket on PATH (see below)\n"
+        "  -C           terminate subprocesses via their cgroups (cgroup v2, see below)\n"
+        "  -d DELAY     stagger the start of subsequent commands by DELAY milliseconds\n"
+        "               default: 0 (start all at once)\n"
+        "  -f FILE      read commands from config file FILE (see below) before those\n"
+        "               given after `---', reloaded on SIGHUP\n"
+        "  -h           show help message\n"
+        "  -k SIGNALS   signals to iterate over in subprocess termination\n"
+        "               (comma-separated list of their numbers or names, each\n"
+        "               optionally followed by `:TIMEOUT' in milliseconds for its\n"
+        "               step, e.g. TERM:250,INT:5000,KILL)\n"
+        "               default: SIGTERM,SIGKILL\n"
+        "  -m ADDRESS   serve metrics in Prometheus text format over HTTP on ADDRESS\n"
+        "               (tcp:[HOST]:PORT, preferably on loopback, or unix:PATH)\n"
+        "  -o MODE      how to pass on output of subprocesses: inherit (subprocesses\n"
+        "               write to muinit's stdout/stderr directly), raw (muinit passes\n"
+        "               it on through pipes) or prefix (muinit passes it on in whole\n"
+        "               lines prefixed by `[NAME PID] ')\n"
+        "               default: inherit\n"
+        "  -P           do not use pidfds for supervising subprocesses\n"
+        "  -r           print a startup report with spawn and exec latencies and a\n"
+        "               resource usage report at exit\n"
+        "  -s SIGNALS   signals to forward to subprocesses (comma-separated numbers\n"
+        "               or names)\n"
+        "               default: SIGINT\n"
+        "  -t TIMEOUT   set subprocess termination stage timeout in seconds (fractions\n"
+        "               allowed) or, with suffix ms, in milliseconds; 0 waits forever\n"
+        "               default: 2s\n"
+        "  -T FILE      write a timeline of the shutdown (termination steps, reaped\n"
+        "               children, exit) to FILE in Chrome's trace event format\n",
+        name);
+
+    if (show_full_help) {
+        printf(
+            "\n"
+            "COMMANDS\n"
+            "     Subprocesses to be spawned and their arguments are given after the\n"
+            "     first '---' and are separated by '---' (do not include quotation marks).\n"
+            "     Though muinit emulates an init session, try not to have subprocesses go\n"
+            "     into background ('daemonize') if possible.\n"
+            "\n"
+            "COMMAND SETTINGS\n"
+            "     Each command can be preceded by settings of the form @KEY=VALUE, e.g.\n"
+            "     `--- @restart=on-failure worker --threads 4':\n"
+            "       @restart=POLICY          restart the subprocess when it exits: never,\n"
+            "                                on-failure or always (default: never)\n"
+            "       @backoff=MIN:MAX         delay restarts by MIN milliseconds, doubled\n"
+            "                                after each restart up to MAX and randomly\n"
+            "                                shortened by up to half (default: 100:30000)\n"
+            "       @max-restarts=N:WINDOW   give up restarting after N restarts within\n"
+            "                                WINDOW seconds (default: 5:60)\n"
+            "       @replicas=N              run N instances of the command, or one per CPU\n"
+            "                                muinit may run on if N is `cpus' (default: 1);\n"
+            "                                each is supervised and restarted on its own and\n"
+            "                                gets its index in MUINIT_REPLICA\n"
+            "       @pin-cpus=yes|no         pin each replica to one of the CPUs muinit may\n"
+            "                                run on (default: no)\n"
+            "       @listen=ADDRESS          listen on ADDRESS (tcp:[HOST]:PORT or unix:PATH)\n"
+            "                                and pass the socket to the subprocess (can be\n"
+            "                                given several times); sockets are passed as fds\n"
+            "                                3, 4, ... with LISTEN_FDS and LISTEN_PID set as\n"
+            "                                for systemd socket activation and are kept open\n"
+            "                                by muinit across restarts\n"
+            "       @reuseport=yes|no        use a separate SO_REUSEPORT socket for each\n"
+            "                                replica for TCP addresses (default: no)\n"
+            "       @env=NAME=VALUE          set environment variable NAME for the command\n"
+            "                                (can be given several times)\n"
+            "       @name=NAME               name to refer to the command by (default: its\n"
+            "                                executable's name)\n"
+            "       @after=NAMES             start the command only once the commands of the\n"
+            "                                given comma-separated names are ready\n"
+            "       @ready=PROBE             consider the command ready (once all replicas\n"
+            "                                have been started) when PROBE (see below)\n"
+            "                                succeeds, checked every 100ms; or with `notify',\n"
+            "                                once all replicas sent READY=1 (see below);\n"
+            "                                without it, commands are ready once started\n"
+            "       @health=PROBE            check the command with PROBE once it is ready\n"
+            "                                and restart all its replicas (via SIGKILL and\n"
+            "                                regardless of @restart) if it fails repeatedly\n"
+            "       @health-interval=MS      check every MS milliseconds (default: 10000)\n"
+            "       @health-timeout=MS       fail checks taking longer (default: 1000)\n"
+            "       @health-retries=N        restart after N failures in a row (default: 3)\n"
+            "       @watchdog=TIMEOUT        kill (and so restart, if set) a replica not\n"
+            "                                sending WATCHDOG=1 at least every TIMEOUT\n"
+            "                                milliseconds (see below)\n"
+            "       @cgroup=NAME             run the command (all its replicas) in cgroup\n"
+            "                                NAME below muinit's (cgroup v2 only; default\n"
+            "                                name INDEX-COMMAND if only limits are given)\n"
+            "       @cpu-max=QUOTA[:PERIOD]  limit CPU time to QUOTA per PERIOD (in us)\n"
+            "       @cpu-weight=N            set relative CPU weight (1-10000, default 100)\n"
+            "       @memory-high=BYTES       throttle memory usage above BYTES\n"
+            "       @memory-max=BYTES        limit memory usage to BYTES\n"
+            "       @io-weight=N             set relative IO weight (1-10000, default 100)\n"
+            "       @stop-signals=SIGNALS    signals (and timeouts) to stop the command with,\n"
+            "                                as for `-k' (default: those given via `-k')\n"
+            "       @stop-phase=N            stop the command in phase N (default: 0)\n"
+            "     Commands with `@ready=notify' or `@watchdog' get a datagram socket in\n"
+            "     NOTIFY_SOCKET to send sd_notify(3) messages to: READY=1, STATUS=...,\n"
+            "     WATCHDOG=1 (with WATCHDOG_USEC and WATCHDOG_PID set), WATCHDOG=trigger\n"
+            "     and MAINPID=... (for processes forking off their main process).\n"
+            "     Probes are tcp:[HOST]:PORT or unix:PATH (accepting connections),\n"
+            "     http:[HOST]:PORT[/PATH] (answering a GET request with status 2xx or\n"
+            "     3xx), file:PATH (existing, and for health checks modified within the\n"
+            "     interval) or exec:COMMAND (exiting with 0; run via /bin/sh only if it\n"
+            "     contains shell syntax); HOST defaults to 127.0.0.1. They are run without\n"
+            "     blocking muinit, readiness probes time out after 1s.\n"
+            "     Commands with `@after' are started once all commands they depend on are\n"
+            "     ready, others right away (in the given order, staggered with `-d').\n"
+            "     muinit moves itself into a cgroup `muinit' below its own if any command\n"
+            "     runs in a cgroup, as controllers can only be enabled for cgroups without\n"
+            "     processes of their own.\n"
+            "     Subprocesses exiting without being restarted cause the termination below.\n"
+            "\n"
+            "CONFIG FILE\n"
+            "     Commands can also be given in a file via `-f', in a section each, named\n"
+            "     by the command's name and with its settings as KEY = VALUE (the command\n"
+            "     settings above without `@'), e.g.\n"
+            "       [web]\n"
+            "       command = nginx -g 'daemon off;'\n"
+            "       replicas = 2\n"
+            "       env = PORT=8080\n"
+            "       after = db\n"
+            "     `command' is split into words at whitespace, with quoting as in the\n"
+            "     shell ('...', \"...\" and \\), other values are taken as they are. Lines\n"
+            "     starting with `#' or `;' are ignored. Section names must be unique.\n"
+            "     On SIGHUP (which is then not forwarded), muinit reloads the file and\n"
+            "     compares its sections with the running commands by name: added ones are\n"
+            "     started, removed ones are stopped like via the control socket, and\n"
+            "     changed ones are stopped and then started anew (taking over their\n"
+            "     sockets). Commands with unchanged settings keep running, only scaled if\n"
+            "     merely `replicas' changed. If the file is invalid, nothing is changed.\n"
+            "     Commands given after `---' are never affected. With a config file,\n"
+            "     muinit keeps running while all commands are stopped or removed.\n"
+            "\n"
+            "CONTROL SOCKET\n"
+            "     With `-c', muinit accepts requests on a UNIX socket (accessible only to\n"
+            "     its user), one per connection as a line of space-separated words, and\n"
+            "     answers with a line of JSON (use `muinitctl' or e.g. socat):\n"
+            "       list                          list commands\n"
+            "       status [NAME [REPLICA]]       show state of all or some replicas\n"
+            "       start NAME [REPLICA]          start stopped replicas\n"
+            "       stop NAME [REPLICA]           stop replicas with the first of their stop\n"
+            "                                     signals (SIGKILL after its timeout); they\n"
+            "                                     are not restarted and, unlike other exits,\n"
+            "                                     do not cause termination\n"
+            "       restart NAME [REPLICA]        stop replicas and start them right away\n"
+            "       signal SIGNAL NAME [REPLICA]  send signal (number or name) to replicas\n"
+            "       scale NAME COUNT              run COUNT replicas of the command\n"
+            "     Without REPLICA, requests apply to all replicas of the command. With a\n"
+            "     control socket, muinit keeps running while all commands are stopped.\n"
+            "     A socket left over at PATH is only replaced if nobody listens on it\n"
+            "     anymore, and it is removed at exit unless replaced meanwhile.\n"
+            "\n"
+            "SIGNAL FORWARDING\n"
+            "     Signals given via the `-s' option (and that can be caught) are forwarded\n"
+            "     to subprocesses. Special cases are SIGCHLD, which is used by muinit itself,\n"
+            "     and SIGTERM, which resets the termination steps and is then forwarded,\n"
+            "     as well as SIGHUP with a config file, which reloads it instead.\n"
+            "     The SIGNALS option values must be lists of comma-separated numbers or\n"
+            "     names (e.g. TERM or SIGTERM) of the signals (run `kill -L' to see a\n"
+            "     list). Subprocesses are kept in a table; orphaned descendants adopted by\n"
+            "     muinit are added to it from procfs before each termination step and\n"
+            "     before forwarding after a subprocess exited.\n"
+            "     Where the kernel supports it (Linux 5.3+), subprocesses are signalled and\n"
+            "     waited for via pidfds (disable with `-P').\n"
+            "\n"
+            "SUBPROCESS TERMINATION\n"
+            "     Once a subprocess terminates (failing or successfully) and is not to be\n"
+            "     restarted, muinit tries to gracefully terminate the other subprocesses.\n"
+            "     This is done in several successive steps until all children have\n"
+            "     terminated. The steps are defined by the signal send in each respective\n"
+            "     step as given via the `-k' option (default: SIGTERM,SIGKILL). The timeout\n"
+            "     to wait after each step before trying the next one can be given via the\n"
+            "     `-t' option (default: 2s) or per step via the `-k' option. muinit exits\n"
+            "     as soon as the last subprocess has been reaped.\n"
+            "     If any command has stop settings, commands are stopped in phases instead:\n"
+            "     phase by phase in ascending order, each command goes through its own stop\n"
+            "     signals, and the next phase starts once all replicas of the commands of\n"
+            "     the current one have exited. Processes left after that go through the\n"
+            "     steps given via `-k'.\n"
+            "     With `-C', each command runs in a cgroup of its own (see above) and each\n"
+            "     step signals all processes in these cgroups instead, including ones that\n"
+            "     escaped from the process tree; the cgroup is frozen meanwhile, so that\n"
+            "     processes forked in between are caught as well. Children outside of these\n"
+            "     cgroups (e.g. if a cgroup could not be set up) are signalled directly.\n"
+            "     SIGKILL is sent via cgroup.kill where supported (Linux 5.14+).\n"
+            "\n"
+            "EXIT STATUS\n"
+            "    Internal errors cause an exit status of 1. Otherwise the exit status equals\n"
+            "    that of the first failed subprocess or 0 if all subprocesses succeed.\n");
+    }
+}
+
+static int put_into_ring(struct log_stream* stream, struct iovec* iov, int count) { /* returns 1 if blocked as the ring buffer is full */
+    size_t size = conf.log_buffer_size;
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (len > size - stream->ring_len) {
+        if (conf.log_overflow == OVERFLOW_BLOCK) {
+            return 1;
+        }
+        if (conf.log_overflow == OVERFLOW_DROP_NEWEST || len > size
+            || drop_oldest_output(stream, len - (size - stream->ring_len)) || len > size - stream->ring_len) {
+            stream->dropped += len;
+            return 0;
+        }
+    }
+    size_t end = (stream->ring_start + stream->ring_len) % size;
+    for (int i = 0; i < count; ++i) {
+        size_t n = iov[i].iov_len < size - end ? iov[i].iov_len : size - end;
+        memcpy(stream->ring + end, iov[i].iov_base, n);
+        memcpy(stream->ring, (char*)iov[i].iov_base + n, iov[i].iov_len - n);
+        end = (end + iov[i].iov_len) % size;
+    }
+    stream->ring_len += len;
+    stream->pending = 1;
+    return 0;
+}
+
+static int read_cgroup_stats(const char* cgroup_path, struct cgroup_stats* stats) { /* returns 1 if not available */
+    if (!cgroup_path) {
+        return 1;
+    }
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/cpu.stat", cgroup_path);
+    FILE* f = n >= 0 && n < (int)sizeof(path) ? fopen(path, "r") : NULL;
+    if (!f) {
+        return 1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    char key[64];
+    uint64_t value;
+    while (fscanf(f, "%63s %" SCNu64, key, &value) == 2) {
+        if (strcmp(key, "user_usec") == 0) {
+            stats->user_time = value;
+        } else if (strcmp(key, "system_usec") == 0) {
+            stats->system_time = value;
+        } else if (strcmp(key, "throttled_usec") == 0) {
+            stats->throttled_time = value;
+        }
+    }
+    fclose(f);
+    n = snprintf(path, sizeof(path), "%s/memory.peak", cgroup_path);
+    f = n >= 0 && n < (int)sizeof(path) ? fopen(path, "r") : NULL; /* Linux 5.19+ and only with the memory controller enabled */
+    if (f) {
+        if (fscanf(f, "%" SCNu64, &stats->memory_peak) != 1) {
+            stats->memory_peak = 0;
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+static void remove_command(struct command* command) { /* stops its instances for good after a config reload and closes its sockets */
+    debug("removing %s\n", command->name);
+    command->removed = 1;
+    conf.drop_pending = 1;
+    cancel_probe(&command->ready_probe);
+    cancel_probe(&command->health_probe);
+    for (int i = 0; i < conf.instances_count; ++i) {
+        struct instance* instance = conf.instances[i];
+        if (instance->command != command) {
+            continue;
+        }
+        stop_instance(instance);
+        if (!instance->started) { /* not waited for anymore */
+            instance->started = 1;
+            ++conf.instances_started;
+        }
+        for (int j = 0; j < command->listen_count; ++j) {
+            if (command->listen_fds[j] < 0 && instance->listen_fds[j] >= 0) {
+                close(instance->listen_fds[j]);
+                instance->listen_fds[j] = -1;
+            }
+        }
+    }
+    for (int j = 0; j < command->listen_count; ++j) {
+        if (command->listen_fds[j] >= 0) {
+            close(command->listen_fds[j]); /* its running instances still have their copies */
+            command->listen_fds[j] = -1;
+        }
+    }
+}
+
+static void restart_instance(struct instance* instance) { /* via the control socket, regardless of the restart policy and without backoff */
+    if (!instance->pid) {
+        start_instance(instance);
+        return;
+    }
+    stop_instance(instance);
+    instance->respawn = 1;
+}
+
+static int resolve_address(const char* address, int passive, struct sockaddr_storage* addr, socklen_t* addr_len) { /* address is tcp:[HOST]:PORT or
+                                                                                                                    unix:PATH */
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un* un = (struct sockaddr_un*)addr;
+        un->sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "socket path too long: %s\n", address + 5);
+            return 1;
+        }
+        strcpy(un->sun_path, address + 5);
+        *addr_len = sizeof(struct sockaddr_un);
+        return 0;
+    }
+    if (strncmp(address, "tcp:", 4) != 0) {
+        fprintf(stderr, "invalid address %s, expected tcp:[HOST]:PORT or unix:PATH\n", address);
+        return 1;
+    }
+    const char* port = strrchr(address + 4, ':');
+    if (!port) {
+        fprintf(stderr, "no port given in %s\n", address);
+        return 1;
+    }
+    char host[256];
+    const char* h = address + 4;
+    size_t host_len = port - h;
+    if (host_len >= 2 && h[0] == '[' && h[host_len - 1] == ']') { /* IPv6 address */
+        ++h;
+        host_len -= 2;
+    }
+    if (host_len >= sizeof(host)) {
+        fprintf(stderr, "host name too long in %s\n", address);
+        return 1;
+    }
+    memcpy(host, h, host_len);
+    host[host_len] = '\0';
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo* res;
+    int rc = getaddrinfo(host_len ? host : passive ? NULL : "127.0.0.1", port + 1, &hints, &res); /* reaches most local servers */
+    if (rc) {
+        fprintf(stderr, "can't resolve %s: %s\n", address, gai_strerror(rc));
+        return 1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int read_number_pair(const char* s, long* a, long* b) { /* reads non-negative numbers of the form A:B */
+    char* next;
+    *a = strtol(s, &next, 10);
+    if (next != s && next[0] == ':') {
+        char* buf = next + 1;
+        *b = strtol(buf, &next, 10);
+        if (next != buf && next[0] == '\0' && *a >= 0 && *b >= 0) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "invalid value %s, expected NUMBER:NUMBER\n", s);
+    return 1;
+}
+
+static int parse_config(const char* path) { /* for read_config */
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "can't open `%s': %m\n", path);
+        return 1;
+    }
+    char* buf = NULL;
+    size_t buf_size = 0;
+    ssize_t len = getdelim(&buf, &buf_size, '\0', f);
+    if (len < 0 && ferror(f)) {
+        fprintf(stderr, "can't read `%s': %m\n", path);
+        fclose(f);
+        free(buf);
+        return 1;
+    }
+    fclose(f);
+    if (len <= 0) {
+        free(buf);
+        return 0;
+    }
+    char* spec = malloc(len + 2); /* settings of a section as KEY=VALUE lines, which never take more room than in the file */
+    if (!spec) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    int rc = parse_config_text(path, buf, spec);
+    free(spec);
+    free(buf);
+    return rc;
+}
+
+static int parse_config_text(const char* path, char* text, char* spec_buf) { /* for parse_config, only values are kept (in the arena) */
+    char* spec = spec_buf;
+    int first = conf.commands_count;
+    struct command* command = NULL;
+    int line_number = 0;
+    for (char* line = text; line;) {
+        char* next = strchr(line, '\n');
+        if (next) {
+            *next = '\0';
+            ++next;
+        }
+        ++line_number;
+        while (isspace((unsigned char)*line)) {
+            ++line;
+        }
+        char* end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1])) {
+            --end;
+        }
+        *end = '\0';
+        if (line[0] == '[' && end[-1] == ']') { /* [NAME] starts the next command */
+            if (command && !command->argv) {
+                fprintf(stderr, "%s:%d: no command given for %s\n", path, line_number, command->name);
+                return 1;
+            }
+            end[-1] = '\0';
+            for (int i = first; i < conf.commands_count; ++i) {
+                if (strcmp(conf.commands[i]->name, line + 1) == 0) {
+                    fprintf(stderr, "%s:%d: duplicate section [%s]\n", path, line_number, line + 1);
+                    return 1;
+                }
+            }
+            if (command) {
+                command->spec = arena_intern(conf.arena, spec_buf, spec - spec_buf);
+                spec = spec_buf;
+            }
+            command = add_command();
+            if (parse_command_setting(command, "name", arena_intern(conf.arena, line + 1, end - line - 2))) {
+                fprintf(stderr, "%s:%d: invalid section\n", path, line_number);
+                return 1;
+            }
+        } else if (line[0] && line[0] != '#' && line[0] != ';') {
+            char* value = strchr(line, '=');
+            if (!value || !command) {
+                fprintf(stderr, "%s:%d: %s\n", path, line_number, value ? "setting outside of a [NAME] section" : "expected KEY = VALUE");
+                return 1;
+            }
+            char* key_end = value;
+            while (key_end > line && isspace((unsigned char)key_end[-1])) {
+                --key_end;
+            }
+            *key_end = '\0';
+            ++value;
+            while (isspace((unsigned char)*value)) {
+                ++value;
+            }
+            if (strcmp(line, "command") == 0) {
+                if (command->argv || !(command->argv = split_words(value))) {
+                    fprintf(stderr, "%s:%d: %s\n", path, line_number, command->argv ? "command given twice" : "invalid command");
+                    return 1;
+                }
+                spec = stpcpy(spec, "command=");
+                for (char** arg = command->argv; *arg; ++arg) {
+                    spec += sprintf(spec, "%s%s", *arg, arg[1] ? "\x1f" : "\n"); /* as split, so that quoting and spacing don't matter */
+                }
+            } else {
+                if (strcmp(line, "replicas") != 0) {
+                    spec += sprintf(spec, "%s=%s\n", line, value);
+                }
+                if (parse_command_setting(command, line, arena_intern(conf.arena, value, strlen(value)))) {
+                    fprintf(stderr, "%s:%d: invalid setting\n", path, line_number);
+                    return 1;
+                }
+            }
+        }
+        line = next;
+    }
+    if (command && !command->argv) {
+        fprintf(stderr, "%s:%d: no command given for %s\n", path, line_number, command->name);
+        return 1;
+    }
+    if (command) {
+        command->spec = arena_intern(conf.arena, spec_buf, spec - spec_buf);
+    }
+    return 0;
+}
+
+static int read_config(const char* path) { /* adds the commands of a config file, with an arena of their own as their settings refer to it */
+    conf.arena = calloc(1, sizeof(struct arena));
+    if (!conf.arena) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    int rc = parse_config(path);
+    if (!conf.arena->users) {
+        free_arena(conf.arena);
+    }
+    conf.arena = NULL;
+    return rc;
+}
+
+static int read_signal(const char* s, char** end) { /* reads a signal number or name (e.g. TERM or SIGTERM), returns -1 if invalid */
+    if (isdigit((unsigned char)*s)) {
+        long val = strtol(s, end, 10);
+        return val > SIGRTMAX ? -1 : val;
+    }
+    *end = (char*)s;
+    const char* name = strncasecmp(s, "SIG", 3) == 0 ? s + 3 : s;
+    size_t len = 0;
+    while (isalnum((unsigned char)name[len])) {
+        ++len;
+    }
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 32)
+    for (int sig = 1; sig < NSIG && len; ++sig) {
+        const char* abbrev = sigabbrev_np(sig);
+        if (abbrev && strlen(abbrev) == len && strncasecmp(abbrev, name, len) == 0) {
+            *end = (char*)name + len;
+            return sig;
+        }
+    }
+#endif
+#endif
+    return -1;
+}
+
+static int read_signals_array(char* s, int* count, int** signals, long** timeouts) { /* as read_signals, growing the arrays as needed */
+    int n = 1;
+    for (const char* c = s; c && *c; ++c) {
+        n += *c == ',';
+    }
+    *signals = realloc(*signals, (*count + n) * sizeof(int));
+    if (!(*signals)) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
+    }
+    if (timeouts) {
+        *timeouts = realloc(*timeouts, (*count + n) * sizeof(long));
+        if (!(*timeouts)) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            return 1;
+        }
+    }
+    return read_signals(s, count, *signals, timeouts ? *timeouts : NULL);
+}
+
+static int read_signals(char* s, int* count, int* signals, long* timeouts) { /* reads a comma-separated list of signal numbers or names from string,
+                                                                              with timeouts (in ms) as SIGNAL:TIMEOUT if timeouts is given,
+                                                                              appending to arrays with room for all of them */
+    if (!s || s[0] == '\0') {
+        fprintf(stderr, "no signals given\n");
+        return 1;
+    }
+    char* buf = s;
+    char* next = buf;
+    while (next[0] != '\0') {
+        int sig = read_signal(buf, &next);
+        long timeout = -1;
+        if (sig < 0) {
+            fprintf(stderr, "invalid signal in %s\n", s);
+            return 1;
+        }
+        if (timeouts && next != buf && next[0] == ':') {
+            buf = next + 1;
+            timeout = strtol(buf, &next, 10);
+            if (next == buf || timeout < 0) {
+                fprintf(stderr, "invalid timeout in %s\n", s);
+                return 1;
+            }
+        }
+        if (next == buf || (next[0] != ',' && next[0] != '\0')) {
+            fprintf(stderr, "unexpected value in %s\n", s);
+            return 1;
+        }
+        signals[*count] = sig;
+        if (timeouts) {
+            timeouts[*count] = timeout;
+        }
+        ++(*count);
+        if (next[0] == ',') {
+            ++next;
+        }
+        buf = next;
+    }
+    return 0;
+}
+
+static int reap_children() { /* reaps children not watched via a pidfd (adopted ones, exec probes), returns 1 if no child is left */
+    int stat;
+    pid_t pid;
+    struct rusage r;
+    while (conf.child_exited) {
+        int abandoned = 0;
+        siginfo_t info;
+        info.si_pid = 0;
+        if ((conf.abandoned_count || conf.use_pidfds) && waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid > 0) {
+            int i = find_child(info.si_pid);
+            if (i >= 0 && conf.children[i].pidfd >= 0) {
+                return 0; /* left to handle_pidfd, its pidfd stays readable until then */
+            }
+            abandoned = conf.abandoned_count && is_abandoned(info.si_pid); /* while its process group can still be looked up */
+        }
+        pid = wait4(info.si_pid > 0 ? info.si_pid : -1, &stat, WNOHANG, &r);
+        if (pid == 0) {
+            conf.child_exited = 0;
+            return 0;
+        }
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ECHILD) {
+                debug("no child left\n");
+                return 1;
+            }
+            debug("wait: other error: %m\n");
+            conf.rc = 1;
+            if (!conf.terminating) {
+                terminate_children();
+            }
+            return 0;
+        }
+        if (WIFEXITED(stat) || WIFSIGNALED(stat)) {
+            int child_rc;
+            if (WIFSIGNALED(stat)) {
+                child_rc = 128 + WTERMSIG(stat);
+            } else {
+                child_rc = WEXITSTATUS(stat);
+            }
+            handle_exit(pid, child_rc, &r, abandoned);
+        }
+    }
+    return 0;
+}
+
+static void reload_config() { /* on SIGHUP, starts added commands, stops removed ones and restarts changed ones of the config file */
+    if (conf.terminating) {
+        return;
+    }
+    debug("reloading %s\n", conf.config_path);
+    int first = conf.commands_count;
+    int instances_count = conf.instances_count;
+    struct command** removing = malloc((first + 1) * sizeof(struct command*));
+    if (!removing) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        exit(1);
+    }
+    int removing_count = 0;
+    int failed = read_config(conf.config_path);
+
+    /* commands are matched by name, unchanged ones are kept (marking the new one as removed) and changed ones are replaced */
+    for (int i = 0; i < first && !failed; ++i) {
+        struct command* old = conf.commands[i];
+        if (!old->spec || old->removed) {
+            continue;
+        }
+        struct command* command = NULL;
+        for (int j = first; j < conf.commands_count && !command; ++j) {
+            if (strcmp(conf.commands[j]->name, old->name) == 0) {
+                command = conf.commands[j];
+            }
+        }
+        int scalable = 1; /* like via the control socket, only once all replicas have been started */
+        for (int j = 0; j < conf.instances_count && command && command->replicas != old->replicas; ++j) {
+            scalable &= conf.instances[j]->command != old || conf.instances[j]->started;
+        }
+        if (command && strcmp(command->spec, old->spec) == 0 && scalable) {
+            command->removed = 1;
+        } else {
+            old->removed = 1;
+            removing[removing_count] = old;
+            ++removing_count;
+        }
+        if (command) {
+            command->replaced = old;
+        }
+    }
+    if (failed || setup_dependencies() || setup_probes(first) || setup_notify_socket() || setup_cgroups(first) || create_instances(first)) {
+        fprintf(stderr, "can't reload %s, keeping the current commands\n", conf.config_path);
+        while (conf.instances_count > instances_count) {
+            --conf.instances_count;
+            free_instance(conf.instances[conf.instances_count]);
+        }
+        while (conf.commands_count > first) {
+            --conf.commands_count;
+            free_command(conf.commands[conf.commands_count]);
+        }
+        for (int i = 0; i < removing_count; ++i) {
+            removing[i]->removed = 0;
+        }
+        free(removing);
+        setup_dependencies(); /* as before, which can't fail */
+        return;
+    }
+
+    /* unchanged commands are dropped from the new ones, which keeps the probe ids of the others as their indices */
+    int count = first;
+    for (int i = first; i < conf.commands_count; ++i) {
+        struct command* command = conf.commands[i];
+        if (command->removed) {
+            if (command->replaced->replicas != command->replicas) {
+                const char* error = scale_command(command->replaced, command->replicas);
+                if (error) {
+                    fprintf(stderr, "can't scale %s: %s\n", command->name, error);
+                }
+            }
+            free_command(command);
+            continue;
+        }
+        debug("%s %s\n", command->replaced ? "replacing" : "adding", command->name);
+        command->ready_probe.id = 2 * count;
+        command->health_probe.id = 2 * count + 1;
+        conf.commands[count] = command;
+        ++count;
+    }
+    conf.commands_count = count;
+    setup_dependencies(); /* for the new indices, can't fail as checked above */
+    for (int i = 0; i < removing_count; ++i) {
+        remove_command(removing[i]);
+    }
+    free(removing);
+    start_instances();
+}
+
+static void remove_child(pid_t pid) {
+    int i = find_child(pid);
+    if (i >= 0) {
+        if (conf.children[i].pidfd >= 0) {
+            unwatch_fd(conf.children[i].pidfd);
+            close(conf.children[i].pidfd);
+        }
+        --conf.children_count;
+        conf.children[i] = conf.children[conf.children_count];
+    }
+}
+
+static int reserve_children(int count) { /* grows the children table to hold at least count children */
+    if (count <= conf.children_capacity) {
+        return 0;
+    }
+    int capacity = conf.children_capacity ? conf.children_capacity : 16;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    struct child* children = realloc(conf.children, capacity * sizeof(struct child));
+    if (!children) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
+    }
+    conf.children = children;
+    conf.children_capacity = capacity;
+    return 0;
+}
+
+static void run_control_command(FILE* f, char* request) { /* runs a request of the form ACTION [ARGS...] and writes the response as JSON */
+    char* args[5];
+    int count = 0;
+    for (char* arg = strtok(request, " \t\r"); arg; arg = strtok(NULL, " \t\r")) {
+        if (count == 5) {
+            fputs("{\"ok\":false,\"error\":\"too many arguments\"}", f);
+            return;
+        }
+        args[count] = arg;
+        ++count;
+    }
+    const char* error = NULL;
+    struct command* command = NULL;
+    int replica = -1;
+    long n = 0;
+    char* end;
+    if (count == 1 && strcmp(args[0], "list") == 0) {
+        fputs("{\"ok\":true,\"commands\":[", f);
+        const char* separator = "";
+        for (int i = 0; i < conf.commands_count; ++i) {
+            if (!conf.commands[i]->removed) {
+                fputs(separator, f);
+                print_command_status(f, conf.commands[i], -1, 0);
+                separator = ",";
+            }
+        }
+        fputs("]}", f);
+        return;
+    } else if (count >= 1 && count <= 3 && strcmp(args[0], "status") == 0) {
+        if (count > 1) {
+            error = parse_control_target(args + 1, count - 1, &command, &replica);
+        }
+        if (!error) {
+            fputs("{\"ok\":true,\"commands\":[", f);
+            const char* separator = "";
+            for (int i = 0; i < conf.commands_count; ++i) {
+                if (command ? command == conf.commands[i] : !conf.commands[i]->removed) {
+                    fputs(separator, f);
+                    print_command_status(f, conf.commands[i], replica, 1);
+                    separator = ",";
+                }
+            }
+            fputs("]}", f);
+            return;
+        }
+    } else if (conf.terminating) {
+        error = "terminating";
+    } else if ((count == 2 || count == 3)
+               && (strcmp(args[0], "start") == 0 || strcmp(args[0], "stop") == 0 || strcmp(args[0], "restart") == 0)) {
+        error = parse_control_target(args + 1, count - 1, &command, &replica);
+    } else if ((count == 3 || count == 4) && strcmp(args[0], "signal") == 0) {
+        n = read_signal(args[1], &end);
+        error = n < 1 || *end ? "invalid signal" : parse_control_target(args + 2, count - 2, &command, &replica);
+    } else if (count == 3 && strcmp(args[0], "scale") == 0) {
+        n = strtol(args[2], &end, 10);
+        error = end == args[2] || *end || n < 0 || n > INT_MAX ? "invalid number of replicas" : parse_control_target(args + 1, 1, &command, &replica);
+    } else {
+        error = "invalid request";
+    }
+    for (int i = 0; i < conf.instances_count && !error; ++i) {
+        if (conf.instances[i]->command == command && !conf.instances[i]->started) {
+            error = "not started yet";
+        }
+    }
+    if (!error && strcmp(args[0], "scale") == 0) {
+        error = scale_command(command, n);
+    } else if (!error) {
+        int running = 0;
+        for (int i = 0; i < conf.instances_count; ++i) {
+            struct instance* instance = conf.instances[i];
+            if (instance->command != command || (replica < 0 ? instance->replica >= command->replicas : instance->replica != replica)) {
+                continue;
+            }
+            if (strcmp(args[0], "start") == 0) {
+                start_instance(instance);
+            } else if (strcmp(args[0], "stop") == 0) {
+                stop_instance(instance);
+            } else if (strcmp(args[0], "restart") == 0) {
+                restart_instance(instance);
+            } else if (instance->pid) {
+                debug("sending signal %ld to %d\n", n, instance->pid);
+                int j = find_child(instance->pid);
+                if ((j >= 0 ? send_signal_to_child(&conf.children[j], n) : kill(instance->pid, n)) == 0) {
+                    ++running;
+                }
+            }
+        }
+        if (strcmp(args[0], "signal") == 0 && !running) {
+            error = "not running";
+        }
+    }
+    if (error) {
+        fprintf(f, "{\"ok\":false,\"error\":\"%s\"}", error);
+    } else {
+        fputs("{\"ok\":true}", f);
+    }
+}
+
+static const char* scale_command(struct command* command, int replicas) { /* via the control socket, returns an error or NULL */
+    int existing = 0;
+    for (int i = 0; i < conf.instances_count; ++i) {
+        struct instance* instance = conf.instances[i];
+        if (instance->command != command) {
+            continue;
+        }
+        ++existing;
+        if (instance->replica >= replicas) {
+            stop_instance(instance);
+        } else if (instance->stopped) {
+            start_instance(instance);
+        }
+    }
+    debug("scaling %s from %d to %d replicas\n", command->name, command->replicas, replicas);
+    command->replicas = replicas;
+    for (int replica = existing; replica < replicas; ++replica) {
+        struct instance* instance = create_instance(command, replica);
+        if (!instance) {
+            command->replicas = replica;
+            return "can't open sockets for new replicas";
+        }
+        instance->started = 1;
+        ++conf.instances_started;
+        spawn(instance);
+    }
+    return NULL;
+}
+
+static int schedule_restart(struct instance* instance, int child_rc) { /* returns 1 if the command is going to be restarted */
+    struct command* command = instance->command;
+    if (!instance->force_restart && (command->restart_policy == RESTART_NEVER || (command->restart_policy == RESTART_ON_FAILURE && child_rc == 0))) {
+        return 0;
+    }
+    uint64_t t = now() - conf.start_time;
+    if (t - instance->spawned_at >= (uint64_t)command->backoff_max * 1000) {
+        instance->backoff_step = 0; /* ran long enough to be considered healthy */
+    }
+    if (t - instance->window_start > (uint64_t)command->restart_window * 1000000) {
+        instance->window_start = t;
+        instance->window_restarts = 0;
+    }
+    if (instance->window_restarts >= command->max_restarts) {
+        fprintf(stderr, "%s (replica %d) restarted %d times within %lds, giving up\n", command->argv[0], instance->replica, instance->window_restarts,
+                command->restart_window);
+        return 0;
+    }
+    ++instance->window_restarts;
+
+    /* exponential backoff with jitter in [delay/2, delay] */
+    uint64_t delay = command->backoff_max;
+    if (instance->backoff_step < 32 && ((uint64_t)command->backoff_min << instance->backoff_step) < delay) {
+        delay = (uint64_t)command->backoff_min << instance->backoff_step;
+    }
+    delay = delay * 500 + rand() % (delay * 500 + 1); /* in us */
+    ++instance->backoff_step;
+
+    debug("restarting %s in %" PRIu64 "ms\n", command->argv[0], delay / 1000);
+    ++conf.restarts_pending;
+    start_timer(&instance->restart_timer, delay);
+    return 1;
+}
+
+static void resync_children() { /* adds adopted children from procfs to the table */
+    FILE* f = fopen(conf.proc_children_path, "r");
+    if (!f) {
+        fprintf(stderr, "can't open `%s': %m\n", conf.proc_children_path);
+        exit(1);
+    }
+
+    pid_t pid;
+    int n;
+    errno = 0;
+    while (1) {
+        n = fscanf(f, "%d", &pid);
+        if (n != 1) {
+            if (errno != 0) {
+                fprintf(stderr, "fscanf on `%s' failed: %m\n", conf.proc_children_path);
+            } else if (n != EOF) {
+                fprintf(stderr, "unexpected value in `%s'\n", conf.proc_children_path);
+            }
+            break;
+        }
+        if (pid > 0 && find_child(pid) < 0 && !find_probe_by_pid(pid)) { /* probes are neither signalled nor waited for as children */
+            debug("adopted child %d\n", pid);
+            if (add_child(pid, NULL)) {
+                exit(1);
+            }
+        }
+    }
+
+    fclose(f);
+    conf.children_dirty = 0;
+}
+
+static void run_timers(uint64_t tick) { /* advances the timer wheel up to the given tick, running the callbacks of due timers */
+    uint64_t next;
+    while ((next = next_timer_tick()) && next <= tick) {
+        conf.timer_tick = next;
+        for (int level = TIMER_LEVELS - 1; level > 0; --level) { /* cascade timers coming closer down to lower levels */
+            int shift = level * TIMER_SLOT_BITS;
+            if (next & (((uint64_t)1 << shift) - 1)) {
+                continue;
+            }
+            int index = (next >> shift) & (TIMER_SLOTS - 1);
+            struct timer* timer = conf.timer_wheel[level][index];
+            conf.timer_wheel[level][index] = NULL;
+            conf.timer_slots_used[level] &= ~((uint64_t)1 << index);
+            while (timer) {
+                struct timer* t = timer->next;
+                uint64_t expires = (timer->deadline + TIMER_TICK - 1) / TIMER_TICK;
+                add_timer(timer, expires > next ? expires : next);
+                timer = t;
+            }
+        }
+        int index = next & (TIMER_SLOTS - 1);
+        struct timer* due = conf.timer_wheel[0][index];
+        conf.timer_wheel[0][index] = NULL;
+        conf.timer_slots_used[0] &= ~((uint64_t)1 << index);
+        if (due) {
+            due->pprev = &due;
+        }
+        while (due) { /* callbacks may stop any of the due timers */
+            struct timer* timer = due;
+            unlink_timer(timer);
+            timer->deadline = 0;
+            timer->callback(timer);
+        }
+    }
+    if (conf.timer_tick < tick) {
+        conf.timer_tick = tick;
+    }
+}
+
+static void set_fd_events(int fd, int kind, int id, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = ((uint64_t)kind << 32) | (uint32_t)id;
+    if (epoll_ctl(conf.epoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+        fprintf(stderr, "epoll_ctl failed: %m\n");
+        exit(1);
+    }
+}
+
+static void signal_cgroup(int cgroup_fd, int sig, struct pids* signalled) { /* signals all processes in the cgroup and adds them to signalled */
+    if (sig == SIGKILL) {
+        int fd = openat(cgroup_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC); /* Linux 5.14+ */
+        if (fd >= 0) {
+            int rc = write(fd, "1", 1);
+            close(fd);
+            if (rc == 1) {
+                return;
+            }
+        }
+    }
+    /* without waiting for the freeze to complete, processes forked meanwhile show up in a later pass */
+    freeze_cgroup(cgroup_fd, 1);
+    for (int pass = 0; pass < CGROUP_SIGNAL_PASSES; ++pass) {
+        int fd = openat(cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+        FILE* f = fd >= 0 ? fdopen(fd, "r") : NULL;
+        if (!f) {
+            fprintf(stderr, "can't read cgroup.procs: %m\n");
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        int sorted = signalled->count;
+        pid_t pid;
+        while (fscanf(f, "%d", &pid) == 1) {
+            if (bsearch(&pid, signalled->pids, sorted, sizeof(pid_t), compare_pids)) {
+                continue;
+            }
+            if (signalled->count == signalled->capacity) {
+                int capacity = signalled->capacity ? 2 * signalled->capacity : 64;
+                pid_t* pids = realloc(signalled->pids, capacity * sizeof(pid_t));
+                if (!pids) {
+                    fprintf(stderr, "can't allocate memory: %m\n");
+                    exit(1);
+                }
+                signalled->pids = pids;
+                signalled->capacity = capacity;
+            }
+            signalled->pids[signalled->count++] = pid;
+            debug("sending signal %d to %d\n", sig, pid);
+            if (kill(pid, sig) && errno != ESRCH) {
+                fprintf(stderr, "kill failed: %m\n");
+            }
+        }
+        fclose(f);
+        if (signalled->count == sorted) {
+            break;
+        }
+        qsort(signalled->pids, signalled->count, sizeof(pid_t), compare_pids);
+    }
+    freeze_cgroup(cgroup_fd, 0);
+}
+
+static void signal_cgroups(int sig) { /* signals the commands' cgroups, and children outside of them (commands without a cgroup, adopted processes) directly */
+    struct pids signalled = {NULL, 0, 0};
+    for (int i = 0; i < conf.commands_count; ++i) {
+        if (conf.commands[i]->cgroup_fd >= 0) {
+            signal_cgroup(conf.commands[i]->cgroup_fd, sig, &signalled);
+        }
+    }
+    if (conf.children_dirty) {
+        resync_children();
+    }
+    for (int i = 0; i < conf.children_count; ++i) {
+        if (!bsearch(&conf.children[i].pid, signalled.pids, signalled.count, sizeof(pid_t), compare_pids)) {
+            send_signal_to_child(&conf.children[i], sig);
+        }
+    }
+    free(signalled.pids);
+}
+
+static void signal_name(char* buf, size_t size, int sig) { /* e.g. SIGTERM, or its number if the name is not known */
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 32)
+    const char* abbrev = sigabbrev_np(sig);
+    if (abbrev) {
+        snprintf(buf, size, "SIG%s", abbrev);
+        return;
+    }
+#endif
+#endif
+    snprintf(buf, size, "signal %d", sig);
+}
+
+static void send_response(struct connection* connection) { /* writes as much as possible without blocking and closes the connection once done */
+    while (connection->response_sent < connection->response_len) {
+        ssize_t n = send(connection->fd, connection->response + connection->response_sent, connection->response_len - connection->response_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return;
+            }
+            break;
+        }
+        connection->response_sent += n;
+    }
+    close_connection(connection);
+}
+
+static int send_signal_to_child(struct child* child, int sig) {
+    debug("sending signal %d to child %d\n", sig, child->pid);
+#ifdef SYS_pidfd_send_signal
+    if (child->pidfd >= 0) {
+        return syscall(SYS_pidfd_send_signal, child->pidfd, sig, NULL, 0);
+    }
+#endif
+    return kill(child->pid, sig);
+}
+
+static void send_signal_to_children(int sig) {
+    uint64_t t = now();
+    if (conf.children_dirty) {
+        resync_children();
+    }
+    for (int i = 0; i < conf.children_count; ++i) {
+        send_signal_to_child(&conf.children[i], sig);
+    }
+    t = now() - t;
+    ++conf.stats.forwarded[sig];
+    conf.stats.forward_time[sig] += t;
+    if (t > conf.stats.forward_time_max) {
+        conf.stats.forward_time_max = t;
+    }
+}
+
+static int setup_cgroups(int first) { /* creates a cgroup below muinit's for each command from first on that needs one */
+    int controllers[CGROUP_LIMITS_COUNT] = {0}; /* indexed like cgroup_limits */
+    int needed = 0;
+    for (int i = first; i < conf.commands_count; ++i) {
+        if (conf.commands[i]->removed) {
+            continue;
+        }
+        for (int j = 0; j < CGROUP_LIMITS_COUNT; ++j) {
+            if (conf.commands[i]->cgroup_limits[j]) {
+                controllers[j] = 1;
+                needed = 1;
+            }
+        }
+        needed |= conf.commands[i]->cgroup != NULL || conf.cgroup_termination;
+    }
+    if (!needed) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    struct stat st;
+    int len = conf.cgroup_path ? snprintf(path, sizeof(path), "%s/cgroup.controllers", conf.cgroup_path) : -1;
+    if (len < 0 || len >= (int)sizeof(path) || stat(path, &st)) {
+        fprintf(stderr, "cgroup v2 not available\n");
+        return 1;
+    }
+
+    /* processes can only be in leaves of a cgroup tree with controllers enabled, so muinit moves into one of its own */
+    snprintf(path, sizeof(path), "%s/muinit", conf.cgroup_path); /* fits as the longer path above did */
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        fprintf(stderr, "can't create cgroup %s: %m\n", path);
+        return 1;
+    }
+    if (write_cgroup_file(path, "cgroup.procs", "0")) {
+        return 1;
+    }
+    for (int j = 0; j < CGROUP_LIMITS_COUNT; ++j) {
+        if (controllers[j]) {
+            char value[16];
+            snprintf(value, sizeof(value), "+%s", cgroup_limits[j].controller);
+            if (write_cgroup_file(conf.cgroup_path, "cgroup.subtree_control", value)) {
+                return 1;
+            }
+        }
+    }
+
+    for (int i = first; i < conf.commands_count; ++i) {
+        struct command* command = conf.commands[i];
+        int has_limits = 0;
+        for (int j = 0; j < CGROUP_LIMITS_COUNT; ++j) {
+            has_limits |= command->cgroup_limits[j] != NULL;
+        }
+        if (command->removed || (!command->cgroup && !has_limits && !conf.cgroup_termination)) {
+            continue;
+        }
+        if (command->cgroup) {
+            len = snprintf(path, sizeof(path), "%s/%s", conf.cgroup_path, command->cgroup);
+        } else {
+            len = snprintf(path, sizeof(path), "%s/%d-%s", conf.cgroup_path, i, basename(command->argv[0]));
+        }
+        if (len >= (int)sizeof(path)) {
+            fprintf(stderr, "cgroup path too long for %s\n", command->name);
+            return 1;
+        }
+        command->cgroup_path = arena_intern(command->arena, path, strlen(path));
+        if (!command->cgroup) {
+            command->cgroup = basename(command->cgroup_path);
+        }
+        if (mkdir(command->cgroup_path, 0755) && errno != EEXIST) {
+            fprintf(stderr, "can't create cgroup %s: %m\n", command->cgroup_path);
+            return 1;
+        }
+        for (int j = 0; j < CGROUP_LIMITS_COUNT; ++j) {
+            if (command->cgroup_limits[j] && write_cgroup_file(command->cgroup_path, cgroup_limits[j].file, command->cgroup_limits[j])) {
+                return 1;
+            }
+        }
+        command->cgroup_fd = open(command->cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (command->cgroup_fd < 0) {
+            fprintf(stderr, "can't open cgroup %s: %m\n", command->cgroup_path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int setup_dependencies() { /* resolves @after of all commands (again after a config reload) and checks for cycles */
+    for (int i = 0; i < conf.commands_count; ++i) {
+        struct command* command = conf.commands[i];
+        /* counted first, so that the array (in the arena) only needs to be replaced if it has to grow on a config reload */
+        for (int pass = 0; pass < 2; ++pass) {
+            int count = 0;
+            for (const char* name = command->after; name && *name && !command->removed;) {
+                size_t len = strcspn(name, ",");
+                int found = 0;
+                for (int j = 0; j < conf.commands_count; ++j) {
+                    if (!conf.commands[j]->removed && strlen(conf.commands[j]->name) == len && strncmp(conf.commands[j]->name, name, len) == 0) {
+                        if (pass) {
+                            command->dependencies[count] = j;
+                        }
+                        ++count;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "unknown command %.*s in @after of %s\n", (int)len, name, command->name);
+                    return 1;
+                }
+                name += len + (name[len] == ',');
+            }
+            if (!pass && count > command->dependencies_capacity) {
+                command->dependencies = arena_alloc(command->arena, count * sizeof(int));
+                command->dependencies_capacity = count;
+            }
+            command->dependencies_count = count;
+        }
+    }
+
+    /* check for cycles by resolving the graph wave by wave */
+    char* resolved = calloc(conf.commands_count, 1);
+    if (!resolved) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
+    }
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int i = 0; i < conf.commands_count; ++i) {
+            struct command* command = conf.commands[i];
+            int ready = !resolved[i] && !command->removed;
+            for (int j = 0; j < command->dependencies_count && ready; ++j) {
+                ready = resolved[command->dependencies[j]] == 1;
+            }
+            if (ready) {
+                resolved[i] = 2; /* resolved in this wave */
+                progress = 1;
+            }
+        }
+        for (int i = 0; i < conf.commands_count; ++i) {
+            if (resolved[i] == 2) {
+                resolved[i] = 1;
+            }
+        }
+    }
+    int rc = 0;
+    for (int i = 0; i < conf.commands_count && !rc; ++i) {
+        if (!resolved[i] && !conf.commands[i]->removed) {
+            fprintf(stderr, "dependency cycle involving %s\n", conf.commands[i]->name);
+            rc = 1;
+        }
+    }
+    free(resolved);
+    return rc;
+}
+
+static int setup_notify_socket() { /* creates the notification socket once any command uses it */
+    if (conf.notify_fd >= 0) {
+        return 0;
+    }
+    int needed = 0;
+    for (int i = 0; i < conf.commands_count; ++i) {
+        needed |= conf.commands[i]->watchdog || conf.commands[i]->ready_probe.kind == PROBE_NOTIFY;
+    }
+    if (!needed) {
+        return 0;
+    }
+    const int one = 1;
+    conf.notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conf.notify_fd < 0) {
+        fprintf(stderr, "socket failed: %m\n");
+        return 1;
+    }
+    /* bind to an unused abstract address chosen by the kernel, so several instances of muinit never collide */
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    socklen_t len = sizeof(sa_family_t);
+    if (setsockopt(conf.notify_fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) || bind(conf.notify_fd, (struct sockaddr*)&addr, len)
+        || (len = sizeof(addr), getsockname(conf.notify_fd, (struct sockaddr*)&addr, &len))) {
+        fprintf(stderr, "can't set up notification socket: %m\n");
+        return 1;
+    }
+    if (asprintf(&conf.notify_socket, "NOTIFY_SOCKET=@%.*s", (int)(len - offsetof(struct sockaddr_un, sun_path) - 1), addr.sun_path + 1) < 0) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
+    }
+    debug("listening for notifications on %s\n", conf.notify_socket + 14);
+    return watch_fd(conf.notify_fd, EVENT_NOTIFY, 0);
+}
+
+static int setup_probes(int first) { /* resolves the addresses of the probes of commands from first on and prepares their commands and requests */
+    for (int i = 2 * first; i < 2 * conf.commands_count; ++i) {
+        struct probe* probe = find_probe(i);
+        struct arena* arena = conf.commands[i / 2]->arena;
+        const char* spec = probe->spec;
+        if (!spec || conf.commands[i / 2]->removed) {
+            continue;
+        }
+        if (strcmp(spec, "notify") == 0) {
+            probe->kind = PROBE_NOTIFY;
+        } else if (strncmp(spec, "exec:", 5) == 0) {
+            /* run directly if possible, as a shell would cost more than many probed commands */
+            const char* command = spec + 5;
+            size_t len = strlen(command);
+            probe->kind = PROBE_EXEC;
+            probe->argv = arena_alloc(arena, (len / 2 + 4) * sizeof(char*));
+            if (strpbrk(command, "\"'\\$`|&;<>()*?[]{}~#=%\n")) {
+                probe->argv[0] = "/bin/sh";
+                probe->argv[1] = "-c";
+                probe->argv[2] = arena_intern(arena, command, len);
+                probe->argv[3] = NULL;
+            } else {
+                int n = 0;
+                for (const char* arg = command + strspn(command, " \t"); *arg; arg += strspn(arg, " \t")) {
+                    size_t arg_len = strcspn(arg, " \t");
+                    probe->argv[n] = arena_intern(arena, arg, arg_len);
+                    ++n;
+                    arg += arg_len;
+                }
+                probe->argv[n] = NULL;
+                if (!n) {
+                    fprintf(stderr, "empty command in probe %s\n", spec);
+                    return 1;
+                }
+            }
+        } else if (strncmp(spec, "http:", 5) == 0) {
+            const char* host = spec + 5;
+            const char* path = strchr(host, '/');
+            int host_len = path ? path - host : (int)strlen(host);
+            char address[300];
+            snprintf(address, sizeof(address), "tcp:%.*s", host_len, host);
+            probe->kind = PROBE_HTTP;
+            if (resolve_address(address, 0, &probe->addr, &probe->addr_len)) {
+                return 1;
+            }
+            const char* format = "GET %s HTTP/1.0\r\nHost: %s%.*s\r\nUser-Agent: muinit\r\nConnection: close\r\n\r\n";
+            path = path ? path : "/";
+            const char* localhost = host[0] == ':' ? "localhost" : "";
+            int n = snprintf(NULL, 0, format, path, localhost, host_len, host);
+            probe->request = arena_alloc(arena, n + 1);
+            snprintf(probe->request, n + 1, format, path, localhost, host_len, host);
+        } else if (strncmp(spec, "file:", 5) == 0) {
+            probe->kind = PROBE_FILE;
+            probe->path = spec + 5;
+        } else {
+            probe->kind = PROBE_CONNECT;
+            if (resolve_address(spec, 0, &probe->addr, &probe->addr_len)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void start_instance(struct instance* instance) { /* via the control socket, right away or once stopped if still running */
+    if (instance->pid) {
+        instance->respawn = instance->stopped;
+        return;
+    }
+    instance->stopped = 0;
+    instance->respawn = 0;
+    if (instance->restart_timer.deadline) {
+        stop_timer(&instance->restart_timer);
+        --conf.restarts_pending;
+    }
+    ++instance->restarts;
+    spawn(instance);
+}
+
+static void start_instances() { /* spawns instances whose dependencies are ready, one per startup delay */
+    if (conf.terminating || conf.startup_timer.deadline) {
+        return;
+    }
+    for (int i = 0; i < conf.instances_count; ++i) {
+        struct instance* instance = conf.instances[i];
+        struct command* command = instance->command;
+        int startable = !instance->started;
+        for (int j = 0; j < command->dependencies_count && startable; ++j) {
+            startable = conf.commands[command->dependencies[j]]->ready;
+        }
+        for (struct command* replaced = command->replaced; replaced && startable; replaced = replaced->replaced) {
+            startable = !is_running(replaced);
+        }
+        if (!startable) {
+            continue;
+        }
+        instance->started = 1;
+        ++conf.instances_started;
+        spawn(instance);
+        if (conf.startup_delay && conf.instances_started < conf.instances_count) {
+            start_timer(&conf.startup_timer, (uint64_t)conf.startup_delay * 1000); /* before becoming ready starts the next ones */
+        }
+        if (instance->replica == command->replicas - 1) { /* all replicas started */
+            if (command->ready_probe.kind == PROBE_NOTIFY) {
+                /* marked ready once all replicas sent READY=1 */
+            } else if (command->ready_probe.kind) {
+                start_timer(&command->ready_probe.timer, 0);
+            } else {
+                mark_ready(command);
+            }
+        }
+        if (conf.startup_delay) {
+            return;
+        }
+    }
+}
+
+static void spawn(struct instance* instance) {
+    struct command* command = instance->command;
+    char* const* args = command->argv;
+#ifdef DEBUG
+    fprintf(stderr, "spawning:");
+    for (int i = 0; args[i]; ++i) {
+        fprintf(stderr, " %s", args[i]);
+    }
+    fprintf(stderr, "\n");
+#endif
+    struct spawn_args spawn_args = {args, instance->envp, -1, instance->listen_fds, command->listen_count, instance->listen_pid, instance->watchdog_pid,
+                                    {-1, -1}, command->cgroup_fd, -1, 0};
+    struct log_stream* streams[2];
+    if (conf.log_mode != LOG_INHERIT) {
+        streams[0] = create_log_stream(instance, STDOUT_FILENO, &spawn_args.output_fds[0]);
+        streams[1] = create_log_stream(instance, STDERR_FILENO, &spawn_args.output_fds[1]);
+    }
+    if (command->pin_cpus && conf.cpus_count) {
+        spawn_args.cpu = conf.cpus[instance->replica % conf.cpus_count];
+    }
+    instance->spawned_at = now() - conf.start_time;
+    instance->exec_latency = 0;
+    instance->notified_ready = 0;
+    instance->force_restart = 0;
+    free(instance->status);
+    instance->status = NULL;
+#ifdef SPAWN_VFORK
+    /* child shares our memory and we are suspended until it called exec, so no page tables are copied */
+    static char stack[SPAWN_STACK_SIZE] __attribute__((aligned(16)));
+    pid_t pid = clone(spawn_child_main, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &spawn_args);
+    if (pid < 0) {
+        fprintf(stderr, "clone failed: %m\n");
+        exit(1);
+    }
+    if (spawn_args.err) {
+        errno = spawn_args.err;
+        fprintf(stderr, "execvp %s failed: %m\n", args[0]);
+    } else {
+        instance->exec_latency = now() - conf.start_time - instance->spawned_at;
+    }
+#else
+    /* exec is not waited for; if needed, it is noticed via a pipe closed on exec */
+    int exec_pipe[2];
+    if (conf.report) {
+        if (pipe2(exec_pipe, O_CLOEXEC)) {
+            fprintf(stderr, "pipe2 failed: %m\n");
+            exit(1);
+        }
+        spawn_args.exec_fd = exec_pipe[1];
+    }
+    pid_t pid = -1;
+#ifdef SYS_clone3
+    if (spawn_args.cgroup_fd >= 0 && !conf.clone3_unsupported) {
+        /* spawn directly into the cgroup (Linux 5.7+), so the child is never accounted to muinit's */
+        struct clone_args clone_args;
+        memset(&clone_args, 0, sizeof(clone_args));
+        clone_args.flags = CLONE_INTO_CGROUP;
+        clone_args.exit_signal = SIGCHLD;
+        clone_args.cgroup = spawn_args.cgroup_fd;
+        pid = syscall(SYS_clone3, &clone_args, sizeof(clone_args));
+        if (pid < 0 && (errno == ENOSYS || errno == E2BIG || errno == EINVAL)) {
+            debug("clone3 with CLONE_INTO_CGROUP not supported, falling back to fork\n");
+            conf.clone3_unsupported = 1;
+        } else if (pid < 0) {
+            debug("clone3 failed, falling back to fork: %m\n");
+        } else if (pid == 0) {
+            spawn_args.cgroup_fd = -1;
+        }
+    }
+#endif
+    if (pid < 0) {
+        pid = fork();
+    }
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %m\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        spawn_child_main(&spawn_args);
+    }
+    if (conf.report) {
+        close(exec_pipe[1]);
+        instance->exec_fd = exec_pipe[0];
+        if (watch_fd(instance->exec_fd, EVENT_EXEC, instance->id)) {
+            exit(1);
+        }
+        ++conf.instances_executing;
+    }
+#endif
+    debug("child spawned: %d\n", pid);
+    if (conf.log_mode != LOG_INHERIT) {
+        for (int i = 0; i < 2; ++i) {
+            close(spawn_args.output_fds[i]);
+            if (command->replicas > 1) {
+                streams[i]->prefix_len =
+                    snprintf(streams[i]->prefix, sizeof(streams[i]->prefix), "[%s.%d %d] ", command->name, instance->replica, pid);
+            } else {
+                streams[i]->prefix_len = snprintf(streams[i]->prefix, sizeof(streams[i]->prefix), "[%s %d] ", command->name, pid);
+            }
+            if (streams[i]->prefix_len >= (int)sizeof(streams[i]->prefix)) {
+                streams[i]->prefix_len = sizeof(streams[i]->prefix) - 1;
+            }
+        }
+    }
+    instance->pid = pid;
+    if (add_child(pid, instance)) {
+        exit(1);
+    }
+    if (command->watchdog) {
+        start_timer(&instance->watchdog_timer, (uint64_t)command->watchdog * 1000);
+    }
+    maybe_print_startup_report();
+}
+
+static char** split_words(char* s) { /* splits s in place at whitespace, with quoting as in the shell, into words interned in the arena of the commands
+                                        being read, returns NULL if empty or invalid */
+    int count = 0;
+    char* out = s;
+    char* p = s;
+    while (1) {
+        while (isspace((unsigned char)*p)) {
+            ++p;
+        }
+        if (!*p) {
+            break;
+        }
+        char quote = 0;
+        while (*p && (quote || !isspace((unsigned char)*p))) {
+            if (quote && *p == quote) {
+                quote = 0;
+                ++p;
+            } else if (!quote && (*p == '\'' || *p == '"')) {
+                quote = *p;
+                ++p;
+            } else {
+                if (*p == '\\' && quote != '\'' && p[1] && (!quote || p[1] == '"' || p[1] == '\\')) {
+                    ++p;
+                }
+                *out = *p;
+                ++out;
+                ++p;
+            }
+        }
+        if (quote) {
+            return NULL;
+        }
+        if (*p) {
+            ++p; /* the separator might be overwritten next */
+        }
+        *out = '\0';
+        ++out;
+        ++count;
+    }
+    if (!count) {
+        return NULL;
+    }
+    char** words = arena_alloc(conf.arena, (count + 1) * sizeof(char*));
+    char* word = s;
+    for (int i = 0; i < count; ++i) {
+        size_t len = strlen(word);
+        words[i] = arena_intern(conf.arena, word, len);
+        word += len + 1;
+    }
+    words[count] = NULL;
+    return words;
+}
+
+static int spawn_child_main(void* arg) { /* may share memory with muinit, so only async-signal-safe calls here */
+    struct spawn_args* spawn_args = arg;
+    int exec_fd = spawn_args->exec_fd;
+    if (spawn_args->output_fds[0] >= 0) {
+        dup2(spawn_args->output_fds[0], STDOUT_FILENO);
+        dup2(spawn_args->output_fds[1], STDERR_FILENO);
+    }
+    if (spawn_args->listen_fds_count) {
+        /* move the sockets to fds 3, 4, ... (first out of the way, as they might overlap) */
+        int n = spawn_args->listen_fds_count;
+        int fds[MAX_LISTEN_FDS];
+        if (exec_fd >= 0 && exec_fd < 3 + n) {
+            exec_fd = fcntl(exec_fd, F_DUPFD_CLOEXEC, 3 + n);
+        }
+        for (int i = 0; i < n; ++i) {
+            fds[i] = fcntl(spawn_args->listen_fds[i], F_DUPFD_CLOEXEC, 3 + n);
+        }
+        for (int i = 0; i < n; ++i) {
+            dup2(fds[i], 3 + i); /* the duplicate is not closed on exec */
+        }
+        write_pid(spawn_args->listen_pid); /* systemd-compatible LISTEN_PID */
+    }
+    if (spawn_args->watchdog_pid) {
+        write_pid(spawn_args->watchdog_pid);
+    }
+    if (spawn_args->cgroup_fd >= 0) { /* not spawned into the cgroup, so join it now */
+        int fd = openat(spawn_args->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "0", 1) < 0) {
+                /* nothing to do about it, the child runs in muinit's cgroup then */
+            }
+            close(fd);
+        }
+    }
+    setpgid(0, 0);
+    sigprocmask(SIG_UNBLOCK, &conf.set, 0);
+    if (spawn_args->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(spawn_args->cpu, &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+    execvpe(spawn_args->argv[0], spawn_args->argv, spawn_args->envp);
+    spawn_args->err = errno;
+#ifndef SPAWN_VFORK
+    fprintf(stderr, "execvp %s failed: %m\n", spawn_args->argv[0]);
+    if (exec_fd >= 0) {
+        if (write(exec_fd, &spawn_args->err, sizeof(spawn_args->err)) < 0) {
+            /* nothing to do about it */
+        }
+    }
+#endif
+    _exit(1);
+}
+
+static void start_probe(struct probe* probe) { /* starts a check, its result is passed to finish_probe */
+    struct command* command = conf.commands[probe->id / 2];
+    probe->running = 1;
+    probe->connected = 0;
+    probe->response_len = 0;
+    start_timer(&probe->timer, (uint64_t)probe->timeout * 1000);
+    if (probe->kind == PROBE_EXEC) {
+        if (probe->pid) { /* an abandoned one is still around */
+            finish_probe(probe, 0);
+            return;
+        }
+        extern char** environ;
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        sigemptyset(&mask);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        int err = posix_spawnp(&probe->pid, probe->argv[0], NULL, &attr, probe->argv, environ);
+        posix_spawnattr_destroy(&attr);
+        if (err) {
+            errno = err;
+            fprintf(stderr, "can't run probe %s: %m\n", probe->spec);
+            probe->pid = 0;
+            finish_probe(probe, 0);
+        }
+    } else if (probe->kind == PROBE_FILE) {
+        struct stat st;
+        int ok = !stat(probe->path, &st);
+        if (ok && probe == &command->health_probe) { /* has to be fresh */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ok = (ts.tv_sec - st.st_mtim.tv_sec) * 1000 + (ts.tv_nsec - st.st_mtim.tv_nsec) / 1000000 <= probe->interval;
+        }
+        finish_probe(probe, ok);
+    } else {
+        /* connected (or not) once writable */
+        probe->fd = socket(probe->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (probe->fd < 0 || watch_fd(probe->fd, EVENT_PROBE, probe->id)) {
+            if (probe->fd < 0) {
+                fprintf(stderr, "socket failed: %m\n");
+            } else {
+                close(probe->fd);
+                probe->fd = -1;
+            }
+            finish_probe(probe, 0);
+        } else if (connect(probe->fd, (struct sockaddr*)&probe->addr, probe->addr_len) && errno != EINPROGRESS) {
+            finish_probe(probe, 0);
+        } else {
+            set_fd_events(probe->fd, EVENT_PROBE, probe->id, EPOLLOUT);
+        }
+    }
+}
+
+static void start_timer(struct timer* timer, uint64_t delay) { /* delay in us */
+    if (timer->deadline) {
+        stop_timer(timer);
+    }
+    uint64_t t = now();
+    int empty = 1;
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        empty &= !conf.timer_slots_used[level];
+    }
+    if (empty) {
+        conf.timer_tick = t / TIMER_TICK; /* nothing to run in between */
+    }
+    timer->deadline = t + delay;
+    uint64_t expires = (timer->deadline + TIMER_TICK - 1) / TIMER_TICK;
+    add_timer(timer, expires > conf.timer_tick ? expires : conf.timer_tick + 1);
+    update_timer_fd();
+}
+
+static void stop_command(struct command* command) { /* sends the next of the command's stop signals to its instances */
+    if (command->stop_stage >= command->stop_signals_count) {
+        fprintf(stderr, "%s did not terminate in time, exiting\n", command->argv[0]);
+        conf.rc = 1;
+        conf.gave_up = 1;
+        return;
+    }
+    int sig = command->stop_signals[command->stop_stage];
+    debug("stopping %s (try %d/%d)\n", command->argv[0], command->stop_stage + 1, command->stop_signals_count);
+    long timeout = command->stop_timeouts[command->stop_stage];
+    if (timeout < 0) {
+        timeout = conf.timeout;
+    }
+    if (timeout) {
+        start_timer(&command->stop_timer, (uint64_t)timeout * 1000);
+    }
+    ++command->stop_stage;
+    if (conf.trace) {
+        char name[128];
+        char args[64];
+        int len = snprintf(name, sizeof(name), "%s: ", command->name);
+        signal_name(name + len, len < (int)sizeof(name) ? sizeof(name) - len : 0, sig);
+        snprintf(args, sizeof(args), "{\"phase\":%d,\"step\":%d}", command->stop_phase, command->stop_stage);
+        trace_event("i", name, 0, now() - conf.start_time, 0, args);
+    }
+    if (conf.cgroup_termination && command->cgroup_fd >= 0) {
+        struct pids signalled = {NULL, 0, 0};
+        signal_cgroup(command->cgroup_fd, sig, &signalled);
+        free(signalled.pids);
+        return;
+    }
+    for (int i = 0; i < conf.instances_count; ++i) {
+        if (conf.instances[i]->command == command && conf.instances[i]->pid) {
+            int j = find_child(conf.instances[i]->pid);
+            if (j >= 0) {
+                send_signal_to_child(&conf.children[j], sig);
+            } else {
+                kill(conf.instances[i]->pid, sig); /* main process set via MAINPID= which is not a child */
+            }
+        }
+    }
+}
+
+static void stop_instance(struct instance* instance) { /* via the control socket, with the command's first stop signal and SIGKILL after its timeout */
+    instance->respawn = 0;
+    if (instance->stopped) {
+        return;
+    }
+    instance->stopped = 1;
+    if (instance->restart_timer.deadline) {
+        stop_timer(&instance->restart_timer);
+        --conf.restarts_pending;
+    }
+    if (!instance->pid) {
+        return;
+    }
+    struct command* command = instance->command;
+    debug("stopping %s (replica %d)\n", command->name, instance->replica);
+    long timeout = command->stop_timeouts[0];
+    if (timeout < 0) {
+        timeout = conf.timeout;
+    }
+    if (timeout) {
+        start_timer(&instance->kill_timer, (uint64_t)timeout * 1000);
+    }
+    kill_instance(instance, command->stop_signals[0]);
+}
+
+static void stop_timer(struct timer* timer) {
+    if (!timer->deadline) {
+        return;
+    }
+    timer->deadline = 0;
+    unlink_timer(timer);
+}
+
+static void terminate_children() { /* starts termination (in phases if configured) or continues with the next global step */
+    stop_timer(&conf.startup_timer); /* commands not started yet are not started anymore */
+    for (int i = 0; i < conf.instances_count; ++i) {
+        if (conf.instances[i]->restart_timer.deadline) {
+            stop_timer(&conf.instances[i]->restart_timer);
+            --conf.restarts_pending;
+        }
+        stop_timer(&conf.instances[i]->watchdog_timer);
+        stop_timer(&conf.instances[i]->kill_timer);
+    }
+    for (int i = 0; i < 2 * conf.commands_count; ++i) {
+        cancel_probe(find_probe(i));
+    }
+    if (!conf.terminating) {
+        conf.terminating = 1;
+        conf.termination_stage = 0;
+        if (!conf.trace_started) {
+            conf.trace_started = now() - conf.start_time;
+        }
+        stop_timer(&conf.termination_timer);
+        if (conf.stop_phases) {
+            for (int i = 0; i < conf.commands_count; ++i) {
+                conf.commands[i]->stop_stage = 0;
+                stop_timer(&conf.commands[i]->stop_timer);
+            }
+            conf.stop_phase = INT_MIN;
+            advance_stop_phase();
+            return;
+        }
+    }
+    if (conf.termination_stage >= conf.termination_signals_count) {
+        fprintf(stderr, "not all children terminated in time, exiting\n");
+        conf.rc = 1;
+        conf.gave_up = 1;
+        return;
     }
-    return 0;
+    debug("terminating children (try %d/%d)\n", conf.termination_stage + 1, conf.termination_signals_count);
+    long timeout = conf.termination_timeouts[conf.termination_stage];
+    if (timeout < 0) {
+        timeout = conf.timeout;
+    }
+    if (timeout) {
+        start_timer(&conf.termination_timer, (uint64_t)timeout * 1000);
+    } else {
+        stop_timer(&conf.termination_timer);
+    }
+    conf.children_dirty = 1; /* always pick up processes adopted from deeper down the tree */
+    uint64_t t = now() - conf.start_time;
+    if (conf.termination_stage) {
+        conf.stats.stage_durations[conf.termination_stage - 1] = t - conf.stats.stage_started;
+    }
+    conf.stats.stage_started = t;
+    trace_stage(conf.termination_stage);
+    if (conf.cgroup_termination) {
+        signal_cgroups(conf.termination_signals[conf.termination_stage]);
+    } else {
+        send_signal_to_children(conf.termination_signals[conf.termination_stage]);
+    }
+    ++conf.termination_stage;
 }
 
-static int register_signal_handler(int sig) {
-    if (signal(sig, signal_handler) == SIG_ERR) {
-        fprintf(stderr, "registering signal %d failed: %m\n", sig);
-        return 1;
+static void trace_event(const char* phase, const char* name, int tid, uint64_t ts, uint64_t dur, const char* args) { /* ts and dur in us, args as a JSON object or NULL */
+    fputs(conf.trace_events ? ",\n" : "\n", conf.trace);
+    fprintf(conf.trace, "{\"ph\":\"%s\",\"name\":", phase);
+    print_json_string(conf.trace, name);
+    fprintf(conf.trace, ",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64, getpid(), tid, ts);
+    if (phase[0] == 'X') {
+        fprintf(conf.trace, ",\"dur\":%" PRIu64, dur);
+    } else if (phase[0] == 'i') {
+        fputs(",\"s\":\"p\"", conf.trace);
     }
-    return 0;
+    if (args) {
+        fprintf(conf.trace, ",\"args\":%s", args);
+    }
+    fputc('}', conf.trace);
+    ++conf.trace_events;
 }
 
-static void send_signal_to_children(int sig) {
-    sigprocmask(SIG_BLOCK, &conf.set, 0);
-
-    FILE* f = fopen(conf.proc_children_path, "r");
-    if (!f) {
-        fprintf(stderr, "can't open `%s': %m\n", conf.proc_children_path);
-        exit(1);
+static void trace_stage(int stage) { /* ends the span of the open termination stage and opens one for stage unless -1 */
+    if (!conf.trace) {
+        return;
     }
-
-    pid_t pid;
-    int n;
-    while (1) {
-        n = fscanf(f, "%d", &pid);
-        if (n != 1) {
-            if (errno != 0) {
-                fprintf(stderr, "fscanf on `%s' failed: %m\n", conf.proc_children_path);
-            } else if (n != EOF) {
-                fprintf(stderr, "unexpected value in `%s'\n", conf.proc_children_path);
-            }
-            break;
-        }
-        if (pid > 0) {
-            debug("sending signal %d to child %d\n", sig, pid);
-            kill(pid, sig);
-        }
+    uint64_t t = now() - conf.start_time;
+    if (conf.trace_stage >= 0) {
+        char name[64];
+        int len = snprintf(name, sizeof(name), "stage %d: ", conf.trace_stage + 1);
+        signal_name(name + len, sizeof(name) - len, conf.termination_signals[conf.trace_stage]);
+        trace_event("X", name, 0, conf.trace_stage_started, t - conf.trace_stage_started, NULL);
     }
-
-    fclose(f);
-
-    sigprocmask(SIG_UNBLOCK, &conf.set, 0);
+    conf.trace_stage = stage;
+    conf.trace_stage_started = t;
 }
 
-static void signal_handler(int sig) {
-    debug("received signal %d\n", sig);
-    switch (sig) {
-        case SIGALRM:
-            terminate_children();
-            break;
-        case SIGTERM:
-            alarm(0);
-            conf.termination_stage = 0;
-            terminate_children();
-            break;
-        default:
-            send_signal_to_children(sig);
-            break;
+static void unlink_timer(struct timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    int level = timer->slot / TIMER_SLOTS;
+    int index = timer->slot % TIMER_SLOTS;
+    if (!conf.timer_wheel[level][index]) {
+        conf.timer_slots_used[level] &= ~((uint64_t)1 << index);
     }
 }
 
-static void spawn(char* const args[]) {
-#ifdef DEBUG
-    fprintf(stderr, "spawning:");
-    for (int i = 0; args[i]; ++i) {
-        fprintf(stderr, " %s", args[i]);
+static void unwatch_fd(int fd) { /* closing is not enough as spawned children may still hold a copy until exec */
+    epoll_ctl(conf.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void update_timer_fd() { /* arms the timerfd for the next tick of the timer wheel with something to do */
+    struct itimerspec value = {{0, 0}, {0, 0}}; /* a zero value disarms the timer */
+    uint64_t tick = next_timer_tick();
+    if (tick == conf.timer_fd_tick) {
+        return;
     }
-    fprintf(stderr, "\n");
-#endif
-    pid_t pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "fork failed: %m\n");
-        exit(1);
+    conf.timer_fd_tick = tick;
+    uint64_t deadline = tick * TIMER_TICK;
+    if (deadline) {
+        value.it_value.tv_sec = deadline / 1000000;
+        value.it_value.tv_nsec = (deadline % 1000000) * 1000;
     }
-    if (pid == 0) {
-        setpgid(0, 0);
-        sigprocmask(SIG_UNBLOCK, &conf.set, 0);
-        execvp(args[0], args);
-        fprintf(stderr, "execvp %s failed: %m\n", args[0]);
+    if (timerfd_settime(conf.timer_fd, TFD_TIMER_ABSTIME, &value, NULL)) {
+        fprintf(stderr, "timerfd_settime failed: %m\n");
         exit(1);
     }
-    debug("child spawned: %d\n", pid);
 }
 
-static int spawn_children(char* argv[]) {
-    char* tmp;
-    char** child_argv = argv;
-    int spawn_count = 0;
-    for (int i = 0; argv[i]; ++i) {
-        tmp = argv[i];
-        if (tmp[0] == '-' && tmp[1] == '-' && tmp[2] == '-' && tmp[3] == '\0') {
-            if (child_argv != argv + i) {
-                argv[i] = NULL;
-                ++spawn_count;
-                spawn(child_argv);
-                argv[i] = tmp;
+static int write_cgroup_file(const char* path, const char* file, const char* value) {
+    char file_path[PATH_MAX];
+    int n = snprintf(file_path, sizeof(file_path), "%s/%s", path, file);
+    if (n < 0 || n >= (int)sizeof(file_path)) {
+        fprintf(stderr, "cgroup path too long: %s/%s\n", path, file);
+        return 1;
+    }
+    int fd = open(file_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+        fprintf(stderr, "can't write `%s' to %s: %m\n", value, file_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void write_fully(int fd, struct iovec* iov, int count) { /* writes all of iov, blocking if necessary but not for long */
+    while (count) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            child_argv = argv + i + 1;
+            if (errno == EAGAIN) { /* only if made non-blocking by someone else */
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                if (poll(&pfd, 1, LOG_WRITE_TIMEOUT) > 0) {
+                    continue;
+                }
+                debug("output not writable in time, dropping it\n");
+            }
+            return; /* nowhere to write to, drop the output */
+        }
+        while (count && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
         }
     }
-    if (child_argv[0]) {
-        ++spawn_count;
-        spawn(child_argv);
+}
+
+static int watch_fd(int fd, int kind, int id) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)kind << 32) | (uint32_t)id;
+    if (epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        fprintf(stderr, "epoll_ctl failed: %m\n");
+        return 1;
     }
-    return spawn_count;
+    return 0;
 }
 
-static void terminate_children() {
-    if (conf.termination_stage >= conf.termination_signals_count) {
-        fprintf(stderr, "not all children terminated in time, exiting\n");
-        exit(1);
+static ssize_t write_output(struct log_output* out, const struct iovec* iov, int count) { /* without blocking unless OUTPUT_BLOCKING */
+    if (out->mode == OUTPUT_SOCKET) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = count;
+        return sendmsg(out->fd, &msg, MSG_DONTWAIT);
     }
-    debug("terminating children (try %d/%d)\n", conf.termination_stage + 1, conf.termination_signals_count);
-    alarm(conf.timeout);
-    send_signal_to_children(conf.termination_signals[conf.termination_stage]);
-    ++conf.termination_stage;
+#ifdef RWF_NOWAIT
+    if (out->mode == OUTPUT_NOWAIT) {
+        ssize_t n = pwritev2(out->fd, iov, count, -1, RWF_NOWAIT); /* Linux 5.8+ for pipes */
+        if (n >= 0 || (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS)) {
+            return n;
+        }
+        debug("can't write output without blocking, making it non-blocking\n");
+        int flags = fcntl(out->fd, F_GETFL);
+        out->mode = flags >= 0 && !fcntl(out->fd, F_SETFL, flags | O_NONBLOCK) ? OUTPUT_NONBLOCKING : OUTPUT_BLOCKING;
+    }
+#endif
+    return writev(out->fd, iov, count);
+}
+
+static void write_pid(char* s) { /* writes the caller's pid into s (room for 11 characters), async-signal-safe for spawned children */
+    char digits[11];
+    int len = 0;
+    for (pid_t pid = getpid(); pid > 0 && len < 11; pid /= 10) {
+        digits[len] = '0' + pid % 10;
+        ++len;
+    }
+    for (int i = 0; i < len; ++i) {
+        s[i] = digits[len - 1 - i];
+    }
+    s[len] = '\0';
 }
 
 int main(int argc, char* argv[]) {
@@ -281,12 +4600,95 @@ int main(int argc, char* argv[]) {
 
     setsid();
 
+    conf.commands = NULL;
+    conf.commands_count = 0;
+    conf.instances = NULL;
+    conf.instances_count = 0;
+    conf.instances_started = 0;
+    conf.commands_ready = 0;
+    conf.instances_executing = 0;
+    conf.cpus = NULL;
+    conf.cpus_count = 0;
+    conf.startup_delay = 0;
+    conf.report = 0;
+    conf.log_mode = LOG_INHERIT;
+    conf.log_streams = NULL;
+    conf.log_streams_count = 0;
+    conf.log_buffer_size = 0;
+    conf.log_overflow = OVERFLOW_BLOCK;
+    for (int i = 0; i < 2; ++i) {
+        conf.log_outputs[i].fd = i + 1;
+        conf.log_outputs[i].pollable = 1;
+        conf.log_outputs[i].mode = OUTPUT_BLOCKING;
+        conf.log_outputs[i].owner = NULL;
+    }
+    conf.log_outputs_shared = 0;
+    conf.splice_unsupported = 0;
+    conf.startup_reported = 0;
+    conf.restarts_pending = 0;
+    conf.drop_pending = 0;
+    memset(conf.timer_wheel, 0, sizeof(conf.timer_wheel));
+    memset(conf.timer_slots_used, 0, sizeof(conf.timer_slots_used));
+    conf.timer_tick = now() / TIMER_TICK;
+    conf.timer_fd_tick = 0;
+    conf.startup_timer.deadline = 0;
+    conf.startup_timer.callback = on_startup_timer;
+    conf.termination_timer.deadline = 0;
+    conf.termination_timer.callback = on_termination_timer;
+    conf.children = NULL;
+    conf.abandoned = NULL;
+    conf.abandoned_count = 0;
+    conf.abandoned_capacity = 0;
+    conf.children_count = 0;
+    conf.children_capacity = 0;
+    conf.children_dirty = 0;
     conf.proc_children_path = NULL;
+    conf.cgroup_path = NULL;
+    conf.clone3_unsupported = 0;
+    conf.cgroup_termination = 0;
     conf.termination_signals = NULL;
+    conf.termination_timeouts = NULL;
     conf.termination_signals_count = 0;
+    conf.use_pidfds = 1;
+    conf.child_exited = 0;
+    conf.terminating = 0;
     conf.termination_stage = 0;
-    conf.timeout = 2;
-    sigfillset(&conf.set);
+    conf.stop_phases = 0;
+    conf.stop_phase = INT_MAX;
+    conf.timeout = 2000;
+    conf.rc = 0;
+    conf.gave_up = 0;
+    sigemptyset(&conf.set);
+    conf.metrics_fd = -1;
+    conf.notify_fd = -1;
+    conf.notify_socket = NULL;
+    conf.main_pids_moved = 0;
+    for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+        conf.metrics_connections[i].fd = -1;
+        conf.metrics_connections[i].response = NULL;
+        conf.metrics_connections[i].timeout.deadline = 0;
+        conf.metrics_connections[i].timeout.callback = on_connection_timeout;
+    }
+    conf.control_fd = -1;
+    conf.control_path = NULL;
+    conf.control_dev = 0;
+    conf.control_ino = 0;
+    conf.config_path = NULL;
+    conf.trace = NULL;
+    conf.trace_events = 0;
+    conf.trace_started = 0;
+    conf.trace_stage = -1;
+    conf.trace_stage_started = 0;
+    for (int i = 0; i < MAX_CONTROL_CONNECTIONS; ++i) {
+        conf.control_connections[i].fd = -1;
+        conf.control_connections[i].response = NULL;
+        conf.control_connections[i].timeout.deadline = 0;
+        conf.control_connections[i].timeout.callback = on_connection_timeout;
+    }
+    memset(&conf.stats, 0, sizeof(conf.stats));
+    conf.arena = NULL;
+    const char* metrics_address = NULL;
+    const char* trace_path = NULL;
 
     int forward_signals_count = 0;
     int* forward_signals = NULL;
@@ -299,9 +4701,105 @@ int main(int argc, char* argv[]) {
         if (arg[0] == '-') {
             if (arg[1] != '\0' && arg[2] == '\0') {
                 switch (arg[1]) {
+                    case 'b': {
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no output buffer size given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        long size = strtol(argv[i], &arg, 10);
+                        if (arg && (*arg == 'k' || *arg == 'K')) {
+                            size *= 1024;
+                            ++arg;
+                        } else if (arg && (*arg == 'm' || *arg == 'M')) {
+                            size *= 1024 * 1024;
+                            ++arg;
+                        }
+                        if (!arg || (arg[0] != '\0' && arg[0] != ':') || size < 2 * LOG_BUFFER_SIZE) {
+                            fprintf(stderr, "invalid output buffer size (must be at least %dk): %s\n", 2 * LOG_BUFFER_SIZE / 1024, argv[i]);
+                            return 1;
+                        }
+                        conf.log_buffer_size = size;
+                        if (arg[0] == '\0' || strcmp(arg, ":block") == 0) {
+                            conf.log_overflow = OVERFLOW_BLOCK;
+                        } else if (strcmp(arg, ":drop-oldest") == 0) {
+                            conf.log_overflow = OVERFLOW_DROP_OLDEST;
+                        } else if (strcmp(arg, ":drop-newest") == 0) {
+                            conf.log_overflow = OVERFLOW_DROP_NEWEST;
+                        } else {
+                            fprintf(stderr, "invalid output buffer policy: %s\n", arg + 1);
+                            return 1;
+                        }
+                        break;
+                    }
+                    case 'c':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no control socket path given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        conf.control_path = argv[i];
+                        break;
+                    case 'C':
+                        conf.cgroup_termination = 1;
+                        break;
+                    case 'd':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no startup delay given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        conf.startup_delay = strtol(argv[i], &arg, 10);
+                        if (!arg || arg[0] != '\0' || conf.startup_delay < 0) {
+                            fprintf(stderr, "invalid startup delay: %s\n", argv[i]);
+                            return 1;
+                        }
+                        break;
+                    case 'f':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no config file given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        conf.config_path = argv[i];
+                        break;
                     case 'h':
                         print_usage(argv[0], 1);
                         return 0;
+                    case 'm':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no metrics address given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        metrics_address = argv[i];
+                        break;
+                    case 'o':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no output mode given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        if (strcmp(argv[i], "inherit") == 0) {
+                            conf.log_mode = LOG_INHERIT;
+                        } else if (strcmp(argv[i], "raw") == 0) {
+                            conf.log_mode = LOG_RAW;
+                        } else if (strcmp(argv[i], "prefix") == 0) {
+                            conf.log_mode = LOG_PREFIX;
+                        } else {
+                            fprintf(stderr, "invalid output mode: %s\n", argv[i]);
+                            return 1;
+                        }
+                        break;
+                    case 'P':
+                        conf.use_pidfds = 0;
+                        break;
                     case 'k': {
                         ++i;
                         if (!argv[i] || argv[i][0] == '\0') {
@@ -309,11 +4807,14 @@ int main(int argc, char* argv[]) {
                             print_usage(argv[0], 0);
                             return 1;
                         }
-                        if (read_signals_array(argv[i], &conf.termination_signals_count, &conf.termination_signals)) {
+                        if (read_signals_array(argv[i], &conf.termination_signals_count, &conf.termination_signals, &conf.termination_timeouts)) {
                             return 1;
                         }
                         break;
                     }
+                    case 'r':
+                        conf.report = 1;
+                        break;
                     case 's': {
                         ++i;
                         if (!argv[i] || argv[i][0] == '\0') {
@@ -321,23 +4822,38 @@ int main(int argc, char* argv[]) {
                             print_usage(argv[0], 0);
                             return 1;
                         }
-                        if (read_signals_array(argv[i], &forward_signals_count, &forward_signals)) {
+                        if (read_signals_array(argv[i], &forward_signals_count, &forward_signals, NULL)) {
                             return 1;
                         }
                         break;
                     }
-                    case 't':
+                    case 't': {
                         ++i;
                         if (!argv[i] || argv[i][0] == '\0') {
                             fprintf(stderr, "no timeout given\n");
                             print_usage(argv[0], 0);
                             return 1;
                         }
-                        conf.timeout = strtol(argv[i], &arg, 10);
-                        if (!arg || arg[0] != '\0' || conf.timeout < 0) {
+                        double timeout = strtod(argv[i], &arg);
+                        if (arg && strcmp(arg, "ms") == 0) {
+                            timeout /= 1000;
+                            arg += 2;
+                        }
+                        if (!arg || arg == argv[i] || arg[0] != '\0' || !(timeout >= 0) || timeout > 1e9) {
                             fprintf(stderr, "invalid timeout: %s\n", argv[i]);
                             return 1;
                         }
+                        conf.timeout = timeout * 1000 + 0.5;
+                        break;
+                    }
+                    case 'T':
+                        ++i;
+                        if (!argv[i] || argv[i][0] == '\0') {
+                            fprintf(stderr, "no trace file given\n");
+                            print_usage(argv[0], 0);
+                            return 1;
+                        }
+                        trace_path = argv[i];
                         break;
                     default:
                         fprintf(stderr, "unexpected argument %s\n", arg);
@@ -355,16 +4871,29 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (conf.log_buffer_size && conf.log_mode == LOG_INHERIT) {
+        fprintf(stderr, "output buffering needs output mode raw or prefix\n");
+        return 1;
+    }
+
     /* default termination signal sequence */
     if (!conf.termination_signals_count) {
         conf.termination_signals_count = 2;
         conf.termination_signals = malloc(conf.termination_signals_count * sizeof(int));
-        if (!conf.termination_signals) {
+        conf.termination_timeouts = malloc(conf.termination_signals_count * sizeof(long));
+        if (!conf.termination_signals || !conf.termination_timeouts) {
             fprintf(stderr, "can't allocate memory: %m\n");
             return 1;
         }
         conf.termination_signals[0] = SIGTERM;
         conf.termination_signals[1] = SIGKILL;
+        conf.termination_timeouts[0] = -1;
+        conf.termination_timeouts[1] = -1;
+    }
+    conf.stats.stage_durations = calloc(conf.termination_signals_count, sizeof(uint64_t));
+    if (!conf.stats.stage_durations) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
     }
 
     /* default signals to forward */
@@ -378,32 +4907,146 @@ int main(int argc, char* argv[]) {
         forward_signals[0] = SIGINT;
     }
 
-    /* block signals during signal handler registration and child spawning */
-    sigprocmask(SIG_BLOCK, &conf.set, 0);
-
-    /* register signals to forward */
+    /* signals to forward */
     for (int i = 0; i < forward_signals_count; ++i) {
-        if (register_signal_handler(forward_signals[i])) {
+        if (forward_signals[i] == SIGKILL || forward_signals[i] == SIGSTOP) {
+            fprintf(stderr, "signal %d can't be forwarded\n", forward_signals[i]);
             return 1;
         }
+        sigaddset(&conf.set, forward_signals[i]);
     }
     free(forward_signals); /* not needed anymore */
 
-    /* SIGALRM needed for termination stages */
-    if (register_signal_handler(SIGALRM)) {
+    /* SIGCHLD needed for reaping */
+    sigaddset(&conf.set, SIGCHLD);
+
+    /* SIGTERM starts termination chain */
+    sigaddset(&conf.set, SIGTERM);
+    if (conf.config_path) {
+        sigaddset(&conf.set, SIGHUP);
+    }
+
+    /* handled signals are blocked and only received via the signalfd (also while spawning children) */
+    if (sigprocmask(SIG_BLOCK, &conf.set, 0)) {
+        fprintf(stderr, "sigprocmask failed: %m\n");
+        return 1;
+    }
+    conf.signal_fd = signalfd(-1, &conf.set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (conf.signal_fd < 0) {
+        fprintf(stderr, "signalfd failed: %m\n");
         return 1;
     }
 
-    /* SIGTERM starts termination chain */
-    if (register_signal_handler(SIGTERM)) {
+    /* timer for startup staggering and termination stages */
+    conf.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (conf.timer_fd < 0) {
+        fprintf(stderr, "timerfd_create failed: %m\n");
+        return 1;
+    }
+
+    conf.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conf.epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1 failed: %m\n");
+        return 1;
+    }
+    if (watch_fd(conf.signal_fd, EVENT_SIGNAL, 0) || watch_fd(conf.timer_fd, EVENT_TIMER, 0)) {
         return 1;
     }
 
+    if (metrics_address) {
+        conf.metrics_fd = open_listen_socket(metrics_address, 0);
+        if (conf.metrics_fd < 0) {
+            return 1;
+        }
+        if (fcntl(conf.metrics_fd, F_SETFL, O_NONBLOCK)) {
+            fprintf(stderr, "fcntl failed: %m\n");
+            return 1;
+        }
+        if (watch_fd(conf.metrics_fd, EVENT_METRICS, 0)) {
+            return 1;
+        }
+    }
+
+    if (trace_path) {
+        conf.trace = fopen(trace_path, "we");
+        if (!conf.trace) {
+            fprintf(stderr, "can't open %s: %m\n", trace_path);
+            return 1;
+        }
+        fputs("{\"traceEvents\":[", conf.trace);
+        trace_event("M", "process_name", 0, 0, 0, "{\"name\":\"muinit\"}");
+        fflush(conf.trace); /* nothing buffered to be copied into children */
+    }
+
+    /* control socket, only accessible to muinit's user */
+    if (conf.control_path) {
+        char* address;
+        if (asprintf(&address, "unix:%s", conf.control_path) < 0) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            return 1;
+        }
+        mode_t mask = umask(077);
+        conf.control_fd = open_listen_socket(address, 0);
+        umask(mask);
+        free(address);
+        struct stat st;
+        if (conf.control_fd < 0) {
+            return 1;
+        }
+        if (stat(conf.control_path, &st) == 0) {
+            conf.control_dev = st.st_dev;
+            conf.control_ino = st.st_ino;
+        }
+        if (fcntl(conf.control_fd, F_SETFL, O_NONBLOCK)) {
+            fprintf(stderr, "fcntl failed: %m\n");
+            return 1;
+        }
+        if (watch_fd(conf.control_fd, EVENT_CONTROL, 0)) {
+            return 1;
+        }
+    }
+
+    /* buffered output is written without blocking whenever stdout/stderr are writable; as their file descriptions are
+       shared with whoever started muinit, O_NONBLOCK is only set on them if there is no other way */
+    struct stat out_stat, err_stat;
+    conf.log_outputs_shared = !fstat(STDOUT_FILENO, &out_stat) && !fstat(STDERR_FILENO, &err_stat)
+                              && out_stat.st_dev == err_stat.st_dev && out_stat.st_ino == err_stat.st_ino;
+    for (int i = 0; conf.log_buffer_size && i < 2 - conf.log_outputs_shared; ++i) {
+        struct log_output* out = &conf.log_outputs[i];
+        struct stat st;
+        if (fstat(out->fd, &st) || S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+            out->mode = OUTPUT_BLOCKING; /* always writable */
+        } else if (S_ISSOCK(st.st_mode)) {
+            out->mode = OUTPUT_SOCKET;
+        } else {
+#ifdef RWF_NOWAIT
+            out->mode = OUTPUT_NOWAIT;
+#else
+            int flags = fcntl(out->fd, F_GETFL);
+            if (flags < 0 || fcntl(out->fd, F_SETFL, flags | O_NONBLOCK)) {
+                fprintf(stderr, "can't make output non-blocking: %m\n");
+                return 1;
+            }
+            out->mode = OUTPUT_NONBLOCKING;
+#endif
+        }
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.u64 = ((uint64_t)EVENT_OUTPUT << 32) | i;
+        if (epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, out->fd, &ev)) {
+            if (errno != EPERM) {
+                fprintf(stderr, "epoll_ctl failed: %m\n");
+                return 1;
+            }
+            out->pollable = 0; /* e.g. regular file, always writable */
+        }
+    }
+
     /* get and test procfs-file to read children from */
     const char* proc_children_format = "/proc/%d/task/%d/children";
     int n = snprintf(NULL, 0, proc_children_format, pid, pid);
     if (n >= 0) {
-        conf.proc_children_path = malloc(n * sizeof(char));
+        conf.proc_children_path = malloc((n + 1) * sizeof(char));
         if (!conf.proc_children_path) {
             fprintf(stderr, "can't allocate memory: %m\n");
             return 1;
@@ -421,50 +5064,198 @@ int main(int argc, char* argv[]) {
     }
     fclose(f);
 
+    /* cgroup v2 to read resource usage of */
+    f = fopen("/proc/self/cgroup", "r");
+    if (f) {
+        char* line = NULL;
+        size_t line_len = 0;
+        while (getline(&line, &line_len, f) > 0) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                if (asprintf(&conf.cgroup_path, "/sys/fs/cgroup%s", strcmp(line + 3, "/") == 0 ? "" : line + 3) < 0) {
+                    fprintf(stderr, "can't allocate memory: %m\n");
+                    return 1;
+                }
+                break;
+            }
+        }
+        free(line);
+        fclose(f);
+    }
+
+    /* CPUs to distribute replicas over */
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+        fprintf(stderr, "sched_getaffinity failed: %m\n");
+        return 1;
+    }
+    conf.cpus = malloc(CPU_COUNT(&cpus) * sizeof(int));
+    if (!conf.cpus) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        return 1;
+    }
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &cpus)) {
+            conf.cpus[conf.cpus_count] = i;
+            ++conf.cpus_count;
+        }
+    }
+
     /* everything ok so far, now spawn the children */
-    if (!spawn_children(first_child_argv)) {
+    if (conf.config_path && read_config(conf.config_path)) {
+        return 1;
+    }
+    if (!parse_commands(first_child_argv)) {
         fprintf(stderr, "no children to spawn\n");
         return 1;
     }
+    if (setup_probes(0) || setup_dependencies() || setup_notify_socket() || setup_cgroups(0) || create_instances(0)) {
+        return 1;
+    }
+    conf.start_time = now();
+    srand(conf.start_time ^ pid);
+    start_instances();
 
-    /* unblock signals after signal handler registration and child spawning */
-    sigprocmask(SIG_UNBLOCK, &conf.set, 0);
-
-    int rc = 0;
-    int stat;
+    /* main event loop */
+    struct epoll_event events[MAX_EVENTS];
+    int n_events;
     while (1) {
-        pid = wait(&stat);
-        if (pid < 0) {
+        n_events = epoll_wait(conf.epoll_fd, events, MAX_EVENTS, -1);
+        if (n_events < 0) {
             if (errno == EINTR) {
-                debug("wait interrupted by signal\n");
-            } else if (errno == ECHILD) {
-                debug("no child left, exiting\n");
-                break;
-            } else {
-                debug("wait: other error: %m\n");
-                rc = 1;
-                if (!conf.termination_stage) {
-                    terminate_children();
-                }
+                continue;
             }
-        } else if (pid > 0 && (WIFEXITED(stat) | WIFSIGNALED(stat))) {
-            int child_rc;
-            if (WIFSIGNALED(stat)) {
-                child_rc = 128 + WTERMSIG(stat);
-            } else {
-                child_rc = WEXITSTATUS(stat);
+            fprintf(stderr, "epoll_wait failed: %m\n");
+            return 1;
+        }
+        for (int i = 0; i < n_events; ++i) {
+            switch (events[i].data.u64 >> 32) {
+                case EVENT_SIGNAL:
+                    handle_signals();
+                    break;
+                case EVENT_TIMER:
+                    handle_timer();
+                    break;
+                case EVENT_PIDFD:
+                    handle_pidfd((pid_t)(uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_EXEC:
+                    handle_exec((uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_LOG:
+                    handle_log((uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_OUTPUT:
+                    flush_output((uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_METRICS:
+                    accept_connections(conf.metrics_fd, conf.metrics_connections, MAX_METRICS_CONNECTIONS, EVENT_METRICS_CONNECTION);
+                    break;
+                case EVENT_METRICS_CONNECTION:
+                    handle_metrics_connection((uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_NOTIFY:
+                    handle_notify();
+                    break;
+                case EVENT_PROBE:
+                    handle_probe((uint32_t)events[i].data.u64);
+                    break;
+                case EVENT_CONTROL:
+                    accept_connections(conf.control_fd, conf.control_connections, MAX_CONTROL_CONNECTIONS, EVENT_CONTROL_CONNECTION);
+                    break;
+                case EVENT_CONTROL_CONNECTION:
+                    handle_control_connection((uint32_t)events[i].data.u64);
+                    break;
             }
-            debug("process %d exited with %d\n", pid, child_rc);
-            if (!rc) {
-                rc = child_rc;
+        }
+        int no_children = reap_children();
+        if (conf.drop_pending && !conf.terminating) {
+            conf.drop_pending = 0;
+            drop_removed_commands();
+        }
+        if (conf.gave_up) {
+            break;
+        }
+        if (no_children
+            && (conf.terminating
+                || (conf.instances_started == conf.instances_count && !conf.restarts_pending && conf.control_fd < 0 && !conf.config_path))) {
+            break;
+        }
+    }
+
+    /* forward remaining output */
+    for (int i = 0; i < 2 - conf.log_outputs_shared && conf.log_buffer_size; ++i) {
+        if (conf.log_outputs[i].mode == OUTPUT_NONBLOCKING) {
+            int flags = fcntl(conf.log_outputs[i].fd, F_GETFL);
+            if (flags >= 0) {
+                fcntl(conf.log_outputs[i].fd, F_SETFL, flags & ~O_NONBLOCK);
             }
-            if (!conf.termination_stage) {
-                terminate_children();
+        }
+        conf.log_outputs[i].mode = OUTPUT_BLOCKING;
+    }
+    for (int i = 0; i < conf.log_streams_count; ++i) {
+        while (conf.log_streams[i] && conf.log_streams[i]->fd >= 0) {
+            int res = handle_log(i);
+            if (res < 0 && conf.log_streams[i]->blocked) {
+                flush_output(conf.log_streams[i]->output);
+            } else if (res < 0) {
+                close_log_stream(conf.log_streams[i]);
             }
         }
     }
+    for (int i = 0; i < 2 - conf.log_outputs_shared && conf.log_buffer_size; ++i) {
+        flush_output(i);
+    }
+
+    finish_trace(conf.rc);
+    if (conf.report) {
+        print_resource_report();
+    }
 
+    free(conf.children);
+    free(conf.abandoned);
+    for (int i = 0; i < conf.instances_count; ++i) {
+        free_instance(conf.instances[i]);
+    }
+    free(conf.instances);
+    free(conf.log_streams); /* after the instances, which check whether their streams are still in use */
+    free(conf.cpus);
+    for (int i = 0; i < conf.commands_count; ++i) {
+        free_command(conf.commands[i]);
+    }
+    free(conf.commands);
     free(conf.proc_children_path);
+    free(conf.cgroup_path);
+    free(conf.termination_signals);
+    free(conf.termination_timeouts);
+    free(conf.stats.stage_durations);
+    for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+        if (conf.metrics_connections[i].fd >= 0) {
+            close_connection(&conf.metrics_connections[i]);
+        }
+    }
+    if (conf.metrics_fd >= 0) {
+        close(conf.metrics_fd);
+    }
+    for (int i = 0; i < MAX_CONTROL_CONNECTIONS; ++i) {
+        if (conf.control_connections[i].fd >= 0) {
+            close_connection(&conf.control_connections[i]);
+        }
+    }
+    if (conf.control_fd >= 0) {
+        struct stat st;
+        close(conf.control_fd);
+        if (stat(conf.control_path, &st) == 0 && st.st_dev == conf.control_dev && st.st_ino == conf.control_ino) {
+            unlink(conf.control_path);
+        }
+    }
+    if (conf.notify_fd >= 0) {
+        close(conf.notify_fd);
+    }
+    free(conf.notify_socket);
+    close(conf.epoll_fd);
+    close(conf.timer_fd);
+    close(conf.signal_fd);
 
-    return rc;
+    return conf.rc;
 }
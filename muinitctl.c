@@ -0,0 +1,155 @@
+/*
+  MIT License
+
+  Copyright (c) 2021 Sven Willner <sven.willner@yfx.de>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void print_usage(const char* name) {
+    printf(
+        "muinitctl -- control a running muinit via its control socket (see `muinit -h')\n"
+        "\n"
+        "Usage:\n"
+        "  %s [-c PATH] REQUEST\n"
+        "\n"
+        "OPTIONS\n"
+        "  -c PATH      control socket of muinit\n"
+        "               default: $MUINIT_CONTROL\n"
+        "  -h           show help message\n"
+        "\n"
+        "REQUESTS\n"
+        "  list                          list commands\n"
+        "  status [NAME [REPLICA]]       show state of all or some replicas\n"
+        "  start NAME [REPLICA]          start stopped replicas\n"
+        "  stop NAME [REPLICA]           stop replicas (they are not restarted)\n"
+        "  restart NAME [REPLICA]        restart replicas right away\n"
+        "  signal SIGNAL NAME [REPLICA]  send signal (number or name) to replicas\n"
+        "  scale NAME COUNT              run COUNT replicas of the command\n"
+        "\n"
+        "The JSON response is written to stdout; the exit status is 1 if the request\n"
+        "failed.\n",
+        name);
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = getenv("MUINIT_CONTROL");
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-h") == 0) {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+        path = argv[i + 1];
+        i += 2;
+    }
+    if (i == argc) {
+        fprintf(stderr, "no request given\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!path || path[0] == '\0') {
+        fprintf(stderr, "no control socket given (-c or MUINIT_CONTROL)\n");
+        return 1;
+    }
+
+    /* request is the arguments on one line */
+    char request[1024];
+    size_t len = 0;
+    for (; i < argc; ++i) {
+        size_t n = strlen(argv[i]);
+        if (n == 0 || strpbrk(argv[i], " \t\r\n") || len + n + 1 >= sizeof(request)) {
+            fprintf(stderr, "invalid argument %s\n", argv[i]);
+            return 1;
+        }
+        memcpy(request + len, argv[i], n);
+        len += n;
+        request[len] = i + 1 < argc ? ' ' : '\n';
+        ++len;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "control socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "can't connect to %s: %m\n", path);
+        return 1;
+    }
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = write(fd, request + sent, len - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "write failed: %m\n");
+            return 1;
+        }
+        sent += n;
+    }
+
+    /* response is one line of JSON, written until muinit closes the connection */
+    char* response = NULL;
+    size_t response_len = 0;
+    FILE* f = open_memstream(&response, &response_len);
+    if (!f) {
+        fprintf(stderr, "open_memstream failed: %m\n");
+        return 1;
+    }
+    char buf[4096];
+    while (1) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "read failed: %m\n");
+            return 1;
+        }
+        if (n == 0) {
+            break;
+        }
+        fwrite(buf, 1, n, f);
+    }
+    fclose(f);
+    close(fd);
+    if (!response_len) {
+        fprintf(stderr, "no response from %s\n", path);
+        free(response);
+        return 1;
+    }
+    fwrite(response, 1, response_len, stdout);
+    int rc = strncmp(response, "{\"ok\":true", 10) != 0;
+    free(response);
+    return rc;
+}
@@ -0,0 +1,79 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* helpers shared by the benchmarks, which run muinit with children that report via a shared memory file */
+
+static inline uint64_t now() { /* in ns */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static inline uint64_t* map_slots(const char* path, size_t count, int create) { /* count values of the file, returns NULL on failure */
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+    if (fd < 0 || (create && ftruncate(fd, count * sizeof(uint64_t)))) {
+        fprintf(stderr, "can't open %s: %m\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    uint64_t* slots = mmap(NULL, count * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (slots == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %m\n");
+        return NULL;
+    }
+    return slots;
+}
+
+static inline pid_t run_muinit(const char* const* argv, const char* stderr_path) { /* stderr_path if given, returns -1 on failure */
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %m\n");
+        return -1;
+    }
+    if (pid == 0) {
+        if (stderr_path) {
+            int fd = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0 || dup2(fd, STDERR_FILENO) < 0) {
+                fprintf(stderr, "can't open %s: %m\n", stderr_path);
+                _exit(1);
+            }
+        }
+        execv(argv[0], (char* const*)argv);
+        fprintf(stderr_path ? stdout : stderr, "can't run %s: %m\n", argv[0]);
+        _exit(1);
+    }
+    return pid;
+}
+
+static inline int wait_for_children(const uint64_t* slots, int count, pid_t pid, uint64_t timeout) { /* of test_child --shm, returns 1 if not in time */
+    uint64_t start = now();
+    for (int i = 0; i < count; ++i) {
+        while (!__atomic_load_n(&slots[2 * i], __ATOMIC_ACQUIRE)) {
+            if (now() - start > timeout || waitpid(pid, NULL, WNOHANG) == pid) {
+                fprintf(stderr, "children did not start\n");
+                return 1;
+            }
+            usleep(1000);
+        }
+    }
+    return 0;
+}
+
+#endif
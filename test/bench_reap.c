@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+/* measures how fast muinit reaps a burst of orphans exiting at once: a child started by muinit (this program with --storm)
+   double-forks COUNT processes, which are adopted by muinit as subreaper and all exit once released; as for any exit, the
+   first one starts termination, so this covers reaping while terminating until no child is left */
+
+#define STORM_TIMEOUT 300000000000ull /* in ns, for creating and reaping all orphans */
+#define SAMPLE_INTERVAL 100            /* in us, between looking at muinit's children while it reaps */
+
+enum { SHM_CREATED, SHM_RELEASE, SHM_EXITED, SHM_COUNT }; /* values in the shared memory file */
+
+static int storm(int count, const char* path) { /* run by muinit, keeps running until terminated */
+    uint64_t* shm = map_slots(path, SHM_COUNT, 0);
+    if (!shm) {
+        return 1;
+    }
+    int fds[2];
+    if (pipe(fds)) {
+        fprintf(stderr, "pipe failed: %m\n");
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork failed after %d orphans: %m\n", i);
+            return 1;
+        }
+        if (pid == 0) {
+            if (fork() == 0) { /* orphaned once its parent exits, waits for the pipe to be closed */
+                char c;
+                close(fds[1]);
+                while (read(fds[0], &c, 1) < 0) {
+                }
+                __atomic_add_fetch(&shm[SHM_EXITED], 1, __ATOMIC_RELAXED);
+                _exit(0);
+            }
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    __atomic_store_n(&shm[SHM_CREATED], 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&shm[SHM_RELEASE], __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    close(fds[1]);
+    while (1) {
+        pause();
+    }
+}
+
+static int count_children(pid_t pid) { /* of the process not reaped yet (including zombies), -1 on error */
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    int n = 0;
+    int child;
+    while (fscanf(f, "%d", &child) == 1) {
+        ++n;
+    }
+    fclose(f);
+    return n;
+}
+
+static uint64_t cpu_time(pid_t pid) { /* of the process in ns */
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+    FILE* f = fopen(path, "r");
+    unsigned long long t = 0;
+    if (f) {
+        if (fscanf(f, "%llu", &t) != 1) {
+            t = 0;
+        }
+        fclose(f);
+    }
+    return t;
+}
+
+static int run(const char* name, const char* muinit_path, const char* option, int count, const char* path, const char* self) { /* returns 1 on failure */
+    uint64_t* shm = map_slots(path, SHM_COUNT, 1);
+    if (!shm) {
+        return 1;
+    }
+    char count_arg[16];
+    snprintf(count_arg, sizeof(count_arg), "%d", count);
+    const char* argv[] = {muinit_path, "---", self, "--storm", count_arg, path, NULL, NULL};
+    if (option) {
+        memmove(argv + 2, argv + 1, 5 * sizeof(char*));
+        argv[1] = option;
+    }
+    pid_t pid = run_muinit(argv, NULL);
+    if (pid < 0) {
+        munmap(shm, SHM_COUNT * sizeof(uint64_t));
+        return 1;
+    }
+
+    int rc = 0;
+    uint64_t start = now();
+    while (!__atomic_load_n(&shm[SHM_CREATED], __ATOMIC_ACQUIRE)) {
+        if (now() - start > STORM_TIMEOUT || waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "orphans were not created\n");
+            rc = 1;
+            break;
+        }
+        usleep(1000);
+    }
+
+    if (!rc) {
+        /* muinit's children are the storm child and the orphans not reaped yet, exited ones of which are zombies; as the list
+           is only sampled, the peak is a lower bound */
+        int peak = 0;
+        uint64_t cpu = cpu_time(pid);
+        uint64_t released = now();
+        __atomic_store_n(&shm[SHM_RELEASE], 1, __ATOMIC_RELEASE);
+        while (1) {
+            int exited = __atomic_load_n(&shm[SHM_EXITED], __ATOMIC_RELAXED);
+            int children = count_children(pid);
+            int zombies = children > 0 ? exited - (count - (children - 1)) : 0;
+            if (zombies > peak) {
+                peak = zombies;
+            }
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+                break; /* exited once nothing is left to reap, not reaped yet so its CPU time can still be read */
+            }
+            if (now() - released > STORM_TIMEOUT) {
+                fprintf(stderr, "orphans were not reaped\n");
+                rc = 1;
+                break;
+            }
+            usleep(SAMPLE_INTERVAL);
+        }
+        uint64_t elapsed = now() - released;
+        cpu = cpu_time(pid) - cpu;
+        if (!rc) {
+            printf("%-6s reaped in %8.1fms (%7.0f reaps/s)  peak %6d zombies (sampled)  muinit CPU %8.1fms (%6.2fus per reap)\n", name, elapsed / 1e6,
+                   count / (elapsed / 1e9), peak, cpu / 1e6, cpu / 1e3 / count);
+            fflush(stdout);
+        }
+    }
+    int status;
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if (!rc && (!WIFEXITED(status) || WEXITSTATUS(status) != 128 + SIGTERM)) { /* as the orphans exit with 0 and the storm child is terminated */
+        fprintf(stderr, "muinit failed\n");
+        rc = 1;
+    }
+    munmap(shm, SHM_COUNT * sizeof(uint64_t));
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    int count = 20000;
+    const char* muinit_path = "./muinit";
+    if (argc == 4 && strcmp(argv[1], "--storm") == 0) {
+        return storm(atoi(argv[2]), argv[3]);
+    }
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--count") == 0 && i < argc - 1) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--muinit") == 0 && i < argc - 1) {
+            muinit_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--count N] [--muinit PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 1) {
+        fprintf(stderr, "invalid count\n");
+        return 1;
+    }
+
+    /* muinit's child runs this program again to cause the storm */
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) {
+        fprintf(stderr, "readlink failed: %m\n");
+        return 1;
+    }
+    self[len] = '\0';
+    char path[] = "/dev/shm/muinit-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "can't create %s: %m\n", path);
+        return 1;
+    }
+    close(fd);
+
+    printf("reaping %d orphans exiting at once with %s\n", count, muinit_path);
+    int rc = run("pidfd", muinit_path, NULL, count, path, self) || run("kill", muinit_path, "-P", count, path, self);
+    unlink(path);
+    return rc;
+}
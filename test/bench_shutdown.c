@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+/* measures a full shutdown of muinit with children that exit right away on SIGTERM (prompt), take a while to do so
+   (slow) or ignore it and have to be killed (stubborn), and breaks it down by means of the trace written with -T */
+
+#define READY_TIMEOUT 30000000000ull    /* in ns, for all children of a group to be spawned */
+#define SHUTDOWN_TIMEOUT 30000000000ull /* in ns, the budget of a typical pod termination */
+#define STOP_DELAY "250"                /* in ms, of the slow children */
+#define TERM_TIMEOUT "1000"             /* in ms, before stubborn children are killed */
+#define MAX_GROUPS 3
+
+static const char* muinit_path = "./muinit";
+static const char* child_path = "test/test_child";
+
+struct group {
+    const char* name;
+    int count;
+    const char* option; /* of test_child */
+    const char* value;
+    char shm_path[32];
+    uint64_t* slots; /* two values per child as written by test_child --shm, the first set once waiting for signals */
+    uint64_t* durations; /* from the start of the shutdown until reaped in us, from the trace */
+    int reaped;
+};
+
+static int read_string(const char* line, const char* key, char* buf, size_t size) { /* a JSON string value (without escapes), returns 1 if missing */
+    const char* s = strstr(line, key);
+    if (!s) {
+        return 1;
+    }
+    s += strlen(key);
+    size_t len = strcspn(s, "\"");
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return 0;
+}
+
+static uint64_t read_number(const char* line, const char* key) { /* 0 if missing */
+    const char* s = strstr(line, key);
+    return s ? strtoull(s + strlen(key), NULL, 10) : 0;
+}
+
+static int report(const char* trace_path, struct group* groups, int groups_count) { /* returns 1 on failure */
+    FILE* f = fopen(trace_path, "r");
+    if (!f) {
+        fprintf(stderr, "can't open %s: %m\n", trace_path);
+        return 1;
+    }
+    /* muinit writes one event per line */
+    char line[1024];
+    char name[256];
+    uint64_t started = 0;
+    uint64_t exited = 0;
+    char stages[8][64];
+    uint64_t stage_times[8][2];
+    int stages_count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (read_string(line, "\"name\":\"", name, sizeof(name))) {
+            continue;
+        }
+        uint64_t ts = read_number(line, "\"ts\":");
+        uint64_t dur = read_number(line, "\"dur\":");
+        if (strstr(line, "\"ph\":\"X\"") && strcmp(name, "shutdown") == 0) {
+            started = ts;
+        } else if (strstr(line, "\"ph\":\"i\"") && strcmp(name, "exit") == 0) {
+            exited = ts;
+        } else if (strstr(line, "\"ph\":\"X\"") && strncmp(name, "stage ", 6) == 0 && stages_count < 8) {
+            snprintf(stages[stages_count], sizeof(stages[0]), "%s", name);
+            stage_times[stages_count][0] = ts;
+            stage_times[stages_count][1] = dur;
+            ++stages_count;
+        } else if (strstr(line, "\"ph\":\"X\"")) {
+            for (int i = 0; i < groups_count; ++i) {
+                if (strcmp(name, groups[i].name) == 0 && groups[i].reaped < groups[i].count) {
+                    groups[i].durations[groups[i].reaped++] = dur;
+                }
+            }
+        }
+    }
+    fclose(f);
+    if (!started || !exited) {
+        fprintf(stderr, "incomplete trace %s\n", trace_path);
+        return 1;
+    }
+
+    for (int i = 0; i < stages_count; ++i) {
+        printf("  %-20s sent at %8.1fms, lasted %8.1fms\n", stages[i], (stage_times[i][0] - started) / 1e3, stage_times[i][1] / 1e3);
+    }
+    for (int i = 0; i < groups_count; ++i) {
+        struct group* group = &groups[i];
+        if (group->reaped < group->count) {
+            fprintf(stderr, "only %d of %d %s children in the trace\n", group->reaped, group->count, group->name);
+            return 1;
+        }
+        qsort(group->durations, group->count, sizeof(uint64_t), compare_u64);
+        printf("  %-20s reaped after p50 %8.1fms, max %8.1fms\n", group->name, group->durations[group->count / 2] / 1e3,
+               group->durations[group->count - 1] / 1e3);
+    }
+    printf("  %-20s at %8.1fms\n", "exit", (exited - started) / 1e3);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int count = 100;
+    const char* trace_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--count") == 0 && i < argc - 1) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i < argc - 1) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--muinit") == 0 && i < argc - 1) {
+            muinit_path = argv[++i];
+        } else if (strcmp(argv[i], "--child") == 0 && i < argc - 1) {
+            child_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--count N] [--trace PATH] [--muinit PATH] [--child PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 10) {
+        fprintf(stderr, "invalid count (must be at least 10)\n");
+        return 1;
+    }
+
+    struct group groups[MAX_GROUPS] = {
+        {"prompt", count, NULL, NULL, "", NULL, NULL, 0},
+        {"slow", count, "--stop-delay", STOP_DELAY, "", NULL, NULL, 0},
+        {"stubborn", count / 10, "--ignore-sigterm", NULL, "", NULL, NULL, 0},
+    };
+    char temp_trace_path[] = "/dev/shm/muinit-trace-XXXXXX";
+    if (!trace_path) {
+        int fd = mkstemp(temp_trace_path);
+        if (fd < 0) {
+            fprintf(stderr, "can't create %s: %m\n", temp_trace_path);
+            return 1;
+        }
+        close(fd);
+        trace_path = temp_trace_path;
+    }
+
+    /* muinit -T TRACE -k TERM:TIMEOUT,KILL --- @name=NAME @replicas=N CHILD --shm PATH --timeout 600 [OPTION [VALUE]] --- ... */
+    const char* args[8 + MAX_GROUPS * 11];
+    char replicas[MAX_GROUPS][32];
+    char names[MAX_GROUPS][32];
+    int n = 0;
+    args[n++] = muinit_path;
+    args[n++] = "-T";
+    args[n++] = trace_path;
+    args[n++] = "-k";
+    args[n++] = "TERM:" TERM_TIMEOUT ",KILL";
+    for (int i = 0; i < MAX_GROUPS; ++i) {
+        struct group* group = &groups[i];
+        strcpy(group->shm_path, "/dev/shm/muinit-bench-XXXXXX");
+        int fd = mkstemp(group->shm_path);
+        if (fd < 0) {
+            fprintf(stderr, "can't create %s: %m\n", group->shm_path);
+            return 1;
+        }
+        close(fd);
+        group->slots = map_slots(group->shm_path, 2 * group->count, 1);
+        if (!group->slots) {
+            return 1;
+        }
+        group->durations = malloc(group->count * sizeof(uint64_t));
+        if (!group->durations) {
+            fprintf(stderr, "can't allocate memory: %m\n");
+            return 1;
+        }
+        snprintf(names[i], sizeof(names[i]), "@name=%s", group->name);
+        snprintf(replicas[i], sizeof(replicas[i]), "@replicas=%d", group->count);
+        args[n++] = "---";
+        args[n++] = names[i];
+        args[n++] = replicas[i];
+        args[n++] = child_path;
+        args[n++] = "--shm";
+        args[n++] = group->shm_path;
+        args[n++] = "--timeout";
+        args[n++] = "600";
+        if (group->option) {
+            args[n++] = group->option;
+        }
+        if (group->value) {
+            args[n++] = group->value;
+        }
+    }
+    args[n] = NULL;
+
+    pid_t pid = run_muinit(args, NULL);
+    if (pid < 0) {
+        return 1;
+    }
+
+    int rc = 0;
+    for (int i = 0; i < MAX_GROUPS && !rc; ++i) {
+        rc = wait_for_children(groups[i].slots, groups[i].count, pid, READY_TIMEOUT);
+    }
+    usleep(100000); /* let muinit settle after spawning */
+
+    if (!rc) {
+        uint64_t sent = now();
+        kill(pid, SIGTERM);
+        while (waitpid(pid, NULL, WNOHANG) != pid) {
+            if (now() - sent > SHUTDOWN_TIMEOUT) {
+                fprintf(stderr, "shutdown took too long\n");
+                kill(pid, SIGKILL);
+                rc = 1;
+                break;
+            }
+            usleep(1000);
+        }
+        if (!rc) {
+            printf("shutting down %d prompt, %d slow (" STOP_DELAY "ms) and %d stubborn children with %s took %.1fms\n", groups[0].count, groups[1].count,
+                   groups[2].count, muinit_path, (now() - sent) / 1e6);
+            rc = report(trace_path, groups, MAX_GROUPS);
+        }
+    } else {
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+
+    for (int i = 0; i < MAX_GROUPS; ++i) {
+        if (groups[i].slots) {
+            munmap(groups[i].slots, 2 * groups[i].count * sizeof(uint64_t));
+            unlink(groups[i].shm_path);
+        }
+        free(groups[i].durations);
+    }
+    if (trace_path == temp_trace_path) {
+        unlink(temp_trace_path);
+    }
+    return rc;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+/* measures the latency from a signal arriving at muinit to its delivery at each of N children it is forwarded to,
+   with the pidfd and the kill (-P) backends of send_signal_to_child() */
+
+#define READY_TIMEOUT 30000000000ull /* in ns, for all children to be spawned */
+#define ROUND_TIMEOUT 5000000000ull  /* in ns, for the signal to reach all children */
+
+static const char* muinit_path = "./muinit";
+static const char* child_path = "test/test_child";
+
+static void stop_muinit(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int run(const char* name, const char* option, int count, int rounds, const char* shm_path) { /* returns 1 on failure */
+    /* two values per child as written by test_child --shm: set once waiting for signals, time the last signal arrived */
+    uint64_t* slots = map_slots(shm_path, 2 * count, 1);
+    if (!slots) {
+        return 1;
+    }
+    uint64_t* latencies = malloc((size_t)rounds * count * sizeof(uint64_t));
+    if (!latencies) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        munmap(slots, 2 * count * sizeof(uint64_t));
+        return 1;
+    }
+
+    char replicas[32];
+    snprintf(replicas, sizeof(replicas), "@replicas=%d", count);
+    const char* argv[] = {muinit_path, "-s", "USR1", "---", replicas, child_path, "--shm", shm_path, "--timeout", "600", NULL, NULL};
+    if (option) {
+        memmove(argv + 2, argv + 1, 10 * sizeof(char*));
+        argv[1] = option;
+    }
+    pid_t pid = run_muinit(argv, NULL);
+    if (pid < 0) {
+        free(latencies);
+        munmap(slots, 2 * count * sizeof(uint64_t));
+        return 1;
+    }
+
+    int rc = wait_for_children(slots, count, pid, READY_TIMEOUT);
+    usleep(100000); /* let muinit settle after spawning */
+
+    for (int r = 0; r < rounds && !rc; ++r) {
+        for (int i = 0; i < count; ++i) {
+            __atomic_store_n(&slots[2 * i + 1], 0, __ATOMIC_RELAXED);
+        }
+        uint64_t sent = now();
+        kill(pid, SIGUSR1);
+        for (int i = 0; i < count && !rc; ++i) {
+            uint64_t received;
+            while (!(received = __atomic_load_n(&slots[2 * i + 1], __ATOMIC_ACQUIRE))) {
+                if (now() - sent > ROUND_TIMEOUT) {
+                    fprintf(stderr, "signal did not reach child %d\n", i);
+                    rc = 1;
+                    break;
+                }
+                sched_yield();
+            }
+            latencies[(size_t)r * count + i] = received - sent;
+        }
+        usleep(1000); /* children back in sigwait */
+    }
+    stop_muinit(pid);
+
+    if (!rc) {
+        size_t n = (size_t)rounds * count;
+        qsort(latencies, n, sizeof(uint64_t), compare_u64);
+        printf("%-6s %5d children  latency p50 %8.1fus  p99 %8.1fus  max %8.1fus\n", name, count, latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3,
+               latencies[n - 1] / 1e3);
+    }
+    free(latencies);
+    munmap(slots, 2 * count * sizeof(uint64_t));
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = 50;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--rounds") == 0 && i < argc - 1) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--muinit") == 0 && i < argc - 1) {
+            muinit_path = argv[++i];
+        } else if (strcmp(argv[i], "--child") == 0 && i < argc - 1) {
+            child_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--rounds N] [--muinit PATH] [--child PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds < 1) {
+        fprintf(stderr, "invalid number of rounds\n");
+        return 1;
+    }
+
+    char shm_path[] = "/dev/shm/muinit-bench-XXXXXX";
+    int fd = mkstemp(shm_path);
+    if (fd < 0) {
+        fprintf(stderr, "can't create %s: %m\n", shm_path);
+        return 1;
+    }
+    close(fd);
+
+    static const int counts[] = {1, 10, 100, 1000};
+    printf("forwarding SIGUSR1 through %s %d times\n", muinit_path, rounds);
+    int rc = 0;
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]) && !rc; ++i) {
+        rc = run("pidfd", NULL, counts[i], rounds, shm_path) || run("kill", "-P", counts[i], rounds, shm_path);
+    }
+    unlink(shm_path);
+    return rc;
+}
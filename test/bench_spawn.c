@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+/* compares spawn latency and throughput of muinit built with the fork and the vfork backend of its spawn(): muinit
+   spawns COUNT replicas one after the other, so the time between two spawns as given by its startup report (-r) is
+   what one spawn() costs muinit (with vfork including the child's time until exec) */
+
+#define READY_TIMEOUT 60000000000ull /* in ns, for all children to be spawned */
+
+static const char* child_path = "test/test_child";
+
+static int compare_doubles(const void* a, const void* b) {
+    double d = *(const double*)a - *(const double*)b;
+    return (d > 0) - (d < 0);
+}
+
+static int run(const char* name, const char* muinit_path, int count, const char* shm_path, const char* report_path) { /* returns 1 on failure */
+    /* two values per child as written by test_child --shm, the first set once waiting for signals */
+    uint64_t* slots = map_slots(shm_path, 2 * count, 1);
+    if (!slots) {
+        return 1;
+    }
+    double* spawned = malloc(count * sizeof(double));
+    if (!spawned) {
+        fprintf(stderr, "can't allocate memory: %m\n");
+        munmap(slots, 2 * count * sizeof(uint64_t));
+        return 1;
+    }
+
+    char replicas[32];
+    snprintf(replicas, sizeof(replicas), "@replicas=%d", count);
+    const char* argv[] = {muinit_path, "-r", "---", replicas, child_path, "--shm", shm_path, "--timeout", "600", NULL};
+    pid_t pid = run_muinit(argv, report_path); /* the startup report goes to stderr */
+    if (pid < 0) {
+        free(spawned);
+        munmap(slots, 2 * count * sizeof(uint64_t));
+        return 1;
+    }
+
+    int rc = wait_for_children(slots, count, pid, READY_TIMEOUT);
+    usleep(100000); /* let muinit print its report */
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    /* lines of the report: pid, replica, spawned (ms), exec (ms), ready (ms), command */
+    int n = 0;
+    FILE* f = rc ? NULL : fopen(report_path, "r");
+    if (f) {
+        char line[512];
+        while (fgets(line, sizeof(line), f) && n < count) {
+            int child_pid;
+            int replica;
+            if (sscanf(line, "%d %d %lf", &child_pid, &replica, &spawned[n]) == 3) {
+                ++n;
+            }
+        }
+        fclose(f);
+    }
+    if (!rc && n < count) {
+        fprintf(stderr, "incomplete startup report in %s\n", report_path);
+        rc = 1;
+    }
+
+    if (!rc) {
+        qsort(spawned, count, sizeof(double), compare_doubles);
+        double total = spawned[count - 1] - spawned[0];
+        for (int i = 0; i < count - 1; ++i) {
+            spawned[i] = spawned[i + 1] - spawned[i]; /* in ms */
+        }
+        qsort(spawned, count - 1, sizeof(double), compare_doubles);
+        printf("%-6s latency p50 %8.1fus  p99 %8.1fus  max %8.1fus  throughput %8.0f spawns/s\n", name, spawned[(count - 1) / 2] * 1e3,
+               spawned[(count - 1) * 99 / 100] * 1e3, spawned[count - 2] * 1e3, (count - 1) / (total / 1e3));
+    }
+    free(spawned);
+    munmap(slots, 2 * count * sizeof(uint64_t));
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    int count = 1000;
+    const char* fork_path = "test/muinit_fork";
+    const char* vfork_path = "test/muinit_vfork";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--count") == 0 && i < argc - 1) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fork") == 0 && i < argc - 1) {
+            fork_path = argv[++i];
+        } else if (strcmp(argv[i], "--vfork") == 0 && i < argc - 1) {
+            vfork_path = argv[++i];
+        } else if (strcmp(argv[i], "--child") == 0 && i < argc - 1) {
+            child_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--count N] [--fork PATH] [--vfork PATH] [--child PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 2) {
+        fprintf(stderr, "invalid count (must be at least 2)\n");
+        return 1;
+    }
+
+    char shm_path[] = "/dev/shm/muinit-bench-XXXXXX";
+    char report_path[] = "/dev/shm/muinit-report-XXXXXX";
+    int fd = mkstemp(shm_path);
+    int report_fd = mkstemp(report_path);
+    if (fd < 0 || report_fd < 0) {
+        fprintf(stderr, "can't create temporary files: %m\n");
+        return 1;
+    }
+    close(fd);
+    close(report_fd);
+
+    printf("spawning %d replicas of %s at once\n", count, child_path);
+    int rc = run("fork", fork_path, count, shm_path, report_path) || run("vfork", vfork_path, count, shm_path, report_path);
+    unlink(shm_path);
+    unlink(report_path);
+    return rc;
+}
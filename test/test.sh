@@ -20,3 +20,303 @@ wait $pid
 res=$?
 echo "------------------"
 echo "Test exited with $res"
+
+# behavior checks, each printing ok or FAIL; the script fails if any does
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failures=0
+check() { # DESCRIPTION COMMAND [ARGS...], passes if the command succeeds
+    if "${@:2}"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failures=$((failures + 1))
+    fi
+}
+between() { # VALUE MIN MAX
+    [ -n "$1" ] && [ "$1" -ge "$2" ] && [ "$1" -le "$3" ]
+}
+runs() { # FILE written to once per run of a command
+    if [ -f "$1" ]; then
+        echo $(($(wc -l < "$1")))
+    else
+        echo 0
+    fi
+}
+gaps() { # FILE of run times in ns, prints the gaps between the runs in ms
+    awk 'NR > 1 { print int(($1 - prev) / 1000000) } { prev = $1 }' "$1"
+}
+trace_ms() { # TRACE NAME, duration of the complete event NAME in ms
+    sed -n "s/.*\"ph\":\"X\",\"name\":\"$2\".*\"dur\":\([0-9]*\).*/\1/p" "$1" | head -n 1 | awk '{ print int($1 / 1000) }'
+}
+record='date +%s%N >> "$0"' # for sh -c with the file as $0
+
+echo "--- restart policy, backoff and max-restarts window"
+./muinit --- @restart=never sh -c "$record; exit 1" "$tmp/never" 2>/dev/null
+check "restart=never: failed command is not restarted" test $? = 1 -a "$(runs "$tmp/never")" = 1
+./muinit --- @restart=on-failure sh -c "$record; exit 0" "$tmp/success" 2>/dev/null
+check "restart=on-failure: successful command is not restarted" test $? = 0 -a "$(runs "$tmp/success")" = 1
+./muinit --- @restart=on-failure @backoff=10:10 @max-restarts=3:60 sh -c "$record; exit 1" "$tmp/failure" 2>"$tmp/failure.err"
+check "restart=on-failure: failed command is restarted until max-restarts" test $? = 1 -a "$(runs "$tmp/failure")" = 4
+check "restart=on-failure: giving up is reported" grep -q "giving up" "$tmp/failure.err"
+./muinit --- @restart=always @backoff=10:10 @max-restarts=2:60 sh -c "$record; exit 0" "$tmp/always" 2>/dev/null
+check "restart=always: successful command is restarted until max-restarts" test $? = 0 -a "$(runs "$tmp/always")" = 3
+./muinit --- @restart=on-failure @backoff=100:400 @max-restarts=3:60 sh -c "$record; exit 1" "$tmp/backoff" 2>/dev/null
+mapfile -t backoff < <(gaps "$tmp/backoff")
+check "backoff: first delay in [MIN/2, MIN]" between "${backoff[0]}" 50 150
+check "backoff: second delay doubled" between "${backoff[1]}" 100 250
+check "backoff: third delay doubled up to MAX" between "${backoff[2]}" 200 450
+./muinit --- @restart=on-failure @backoff=10:10 @max-restarts=1:1 sh -c "$record; sleep 0.1; exit 1" "$tmp/window" 2>/dev/null
+check "max-restarts: second restart within the window gives up" test "$(runs "$tmp/window")" = 2
+./muinit --- @restart=on-failure @backoff=10:10 @max-restarts=1:1 sh -c "$record; sleep 0.6; exit 1" "$tmp/window_passed" 2>/dev/null
+check "max-restarts: restarts count again once the window has passed" test "$(runs "$tmp/window_passed")" = 3
+
+echo "--- listening sockets"
+./muinit -o raw --- @listen=unix:"$tmp/listen.sock" @replicas=2 sh -c 'echo "$LISTEN_FDS $LISTEN_PID $$ $(readlink /proc/$$/fd/3)"; sleep 0.2' \
+    > "$tmp/listen.out" 2>/dev/null
+check "listen: LISTEN_FDS and LISTEN_PID set" test "$(awk '$1 == 1 && $2 == $3' "$tmp/listen.out" | wc -l)" = 2
+check "listen: socket passed as fd 3 and shared by the replicas" test "$(awk '{ print $4 }' "$tmp/listen.out" | grep "^socket:" | sort -u | wc -l)" = 1
+./muinit -o raw --- @listen=unix:"$tmp/listen.sock" @restart=on-failure @backoff=10:10 @max-restarts=1:60 sh -c 'readlink /proc/$$/fd/3; exit 1' \
+    > "$tmp/listen_restart.out" 2>/dev/null
+check "listen: socket kept across restarts" test "$(runs "$tmp/listen_restart.out")" = 2 -a "$(sort -u "$tmp/listen_restart.out" | wc -l)" = 1
+
+echo "--- output overflow policies"
+for policy in block drop-oldest drop-newest; do
+    ./muinit -o raw -b 128k:$policy --- sh -c 'head -c 1048576 /dev/zero | tr "\0" x; echo END' 2>"$tmp/$policy.err" | {
+        sleep 0.5
+        cat > "$tmp/$policy.out"
+    }
+done
+check "overflow block: all output passed on" test "$(wc -c < "$tmp/block.out")" = 1048580
+check "overflow block: nothing dropped" test -z "$(grep "^dropped" "$tmp/block.err")"
+check "overflow drop-oldest: latest output kept" test "$(tail -c 4 "$tmp/drop-oldest.out")" = END
+check "overflow drop-oldest: output dropped and reported" grep -q "^dropped" "$tmp/drop-oldest.err"
+check "overflow drop-newest: latest output dropped" test "$(wc -c < "$tmp/drop-newest.out")" -lt 1048576 -a "$(tail -c 4 "$tmp/drop-newest.out")" != END
+check "overflow drop-newest: dropping reported" grep -q "^dropped" "$tmp/drop-newest.err"
+check "buffered output of all runs passed on" test "$(./muinit -o raw -b 128k --- @restart=on-failure @backoff=10:10 @max-restarts=3:60 sh -c 'echo run; exit 1' 2>/dev/null | grep -c run)" = 4
+./muinit -o raw --- sh -c 'head -c 1048576 /dev/zero | tr "\0" x' 2>/dev/null | {
+    sleep 0.5
+    awk '{ print $14 + $15 }' /proc/"$(pgrep -n -x muinit)"/stat > "$tmp/unbuffered.cpu"
+    cat > "$tmp/unbuffered.out"
+}
+check "unbuffered: waits for the output without busy looping" test "$(cat "$tmp/unbuffered.cpu")" -lt 10
+check "unbuffered: all output passed on" test "$(wc -c < "$tmp/unbuffered.out")" = 1048576
+
+echo "--- metrics endpoint"
+scrape() { # SOCKET, prints the metrics without comments
+    curl -s --unix-socket "$1" http://localhost/metrics | grep -v "^#"
+}
+./muinit -s USR1 -m unix:"$tmp/metrics.sock" \
+    --- @name=crash @restart=always @backoff=100:100 @max-restarts=100:60 sh -c 'exit 3' \
+    --- @name=app test/test_child --timeout 30 2>/dev/null &
+pid=$!
+sleep 0.5
+kill -USR1 $pid
+sleep 0.1
+scrape "$tmp/metrics.sock" > "$tmp/metrics.out"
+kill $pid
+wait $pid
+check "metrics: restarts counted" between "$(sed -n 's/^muinit_instance_restarts_total{command="crash",.*} //p' "$tmp/metrics.out")" 3 12
+check "metrics: last exit code" grep -q '^muinit_instance_last_exit_code{command="crash",.*} 3$' "$tmp/metrics.out"
+check "metrics: running instance up" grep -q '^muinit_instance_up{command="app",.*} 1$' "$tmp/metrics.out"
+check "metrics: reaped children counted" between "$(sed -n 's/^muinit_reaped_total //p' "$tmp/metrics.out")" 3 13
+check "metrics: forwarded signals counted" grep -q '^muinit_signals_forwarded_total{signal="10"} 1$' "$tmp/metrics.out"
+
+echo "--- per-stage termination timeouts across timer wheel levels"
+./muinit -T "$tmp/timers.json" -k TERM:7,INT:300,HUP:4200,KILL --- test/test_child --timeout 30 --ignore-sigterm 2>/dev/null &
+pid=$!
+sleep 0.2
+kill $pid
+wait $pid
+check "timer of 7ms (level 0)" between "$(trace_ms "$tmp/timers.json" "stage 1: SIGTERM")" 6 57
+check "timer of 300ms (level 1)" between "$(trace_ms "$tmp/timers.json" "stage 2: SIGINT")" 299 350
+check "timer of 4200ms (level 2)" between "$(trace_ms "$tmp/timers.json" "stage 3: SIGHUP")" 4199 4250
+./muinit -k TERM:5000,KILL --- test/test_child --timeout 30 2>/dev/null &
+pid=$!
+sleep 0.2
+start=$(date +%s%N)
+kill $pid
+wait $pid
+check "shutdown finishes once the last child is reaped" test $((($(date +%s%N) - start) / 1000000)) -lt 1000
+
+echo "--- stop phases"
+./muinit -T "$tmp/phases.json" \
+    --- @name=web @stop-phase=0 test/test_child --timeout 30 --stop-delay 300 \
+    --- @name=db @stop-phase=1 test/test_child --timeout 30 \
+    --- @name=stubborn @stop-phase=1 @stop-signals=INT:100,KILL test/test_child --timeout 30 --ignore-sigterm 2>"$tmp/phases.err" &
+pid=$!
+sleep 0.3
+kill $pid
+wait $pid
+check "stop phases: phase 0 stops first" between "$(trace_ms "$tmp/phases.json" web)" 300 400
+check "stop phases: phase 1 waits for phase 0" between "$(trace_ms "$tmp/phases.json" db)" "$(trace_ms "$tmp/phases.json" web)" 450
+check "stop phases: stop signals with their timeouts" between "$(trace_ms "$tmp/phases.json" stubborn)" 400 550
+check "stop phases: stop signals of a command only sent to it" test "$(grep -c "^child [0-9]*: received signal 2:" "$tmp/phases.err")" = 1 \
+    -a "$(grep -c "^child [0-9]*: received signal 15:" "$tmp/phases.err")" = 2
+./muinit -t 2 --- @stop-phase=0 @ready=notify sh -c 'sh -c "exec test/test_child --timeout 30 --notify MAINPID=\$\$ --notify READY=1" & wait' 2>/dev/null &
+pid=$!
+sleep 0.3
+kill $pid
+wait $pid
+check "stop phases: main process set via MAINPID= is signalled" test $? = 0
+
+echo "--- dependencies and readiness"
+./muinit -o raw \
+    --- @name=db @ready=file:"$tmp/db.ready" sh -c 'sleep 0.2; touch "$0/db.ready"; sleep 30' "$tmp" \
+    --- @name=web @after=db @ready="exec:test -e $tmp/web.ready" sh -c 'echo "web $(test -e "$0/db.ready" && echo after db)"; sleep 0.2; touch "$0/web.ready"; sleep 30' "$tmp" \
+    --- @name=app @after=web sh -c 'echo "app $(test -e "$0/web.ready" && echo after web)"' "$tmp" > "$tmp/after.out" 2>/dev/null
+check "after: started once a file probe succeeded" grep -qx "web after db" "$tmp/after.out"
+check "after: started once an exec probe succeeded" grep -qx "app after web" "$tmp/after.out"
+
+echo "--- sd_notify"
+./muinit -o raw \
+    --- @name=daemon @ready=notify sh -c 'sleep 0.2; touch "$0/notified"; exec test/test_child --timeout 30 --notify READY=1' "$tmp" \
+    --- @after=daemon sh -c 'test -e "$0/notified" && echo after READY=1' "$tmp" > "$tmp/notify.out" 2>/dev/null
+check "READY=1: dependents started once sent" grep -qx "after READY=1" "$tmp/notify.out"
+start=$(date +%s%N)
+./muinit --- @ready=notify sh -c 'sh -c "exec test/test_child --timeout 1 --notify MAINPID=\$\$ --notify READY=1" & sleep 0.1' 2>/dev/null
+check "MAINPID=: the process forked off is supervised instead" test $? = 0 -a $((($(date +%s%N) - start) / 1000000)) -ge 900
+./muinit --- @watchdog=200 test/test_child --timeout 1 --watchdog 50 2>"$tmp/watchdog.err"
+check "WATCHDOG=1: command sending it is kept running" test $? = 0 -a -z "$(grep "watchdog timeout" "$tmp/watchdog.err")"
+./muinit --- @watchdog=200 @restart=always @backoff=10:10 @max-restarts=2:60 sh -c "$record; sleep 30" "$tmp/watchdog" 2>/dev/null
+mapfile -t watchdog < <(gaps "$tmp/watchdog")
+check "WATCHDOG=1: command not sending it is killed and restarted" test "$(runs "$tmp/watchdog")" = 3
+check "WATCHDOG=1: killed after the timeout" between "${watchdog[0]}" 200 300
+
+echo "--- adopted processes"
+./muinit -s USR1 --- @restart=always @backoff=1000:1000 sh -c 'test/test_child --timeout 30 & sleep 0.1' 2>"$tmp/adopted.err" &
+pid=$!
+sleep 0.3
+kill -USR1 $pid
+sleep 0.1
+kill $pid
+wait $pid
+check "signals forwarded to processes left behind by a command" grep -q "^child [0-9]*: received signal 10" "$tmp/adopted.err"
+
+echo "--- health checks"
+# the second command leaves a process behind on each run, so forwarding a signal picks up adopted processes
+./muinit -s USR1 \
+    --- @health="exec:sleep 0.5; date +%s%N >> $tmp/probe" @health-interval=600 test/test_child --timeout 30 \
+    --- @restart=always @backoff=10:10 @max-restarts=100:60 sh -c 'trap "" USR1; sleep 30 & sleep 0.2' 2>"$tmp/probe.err" &
+pid=$!
+for i in $(seq 12); do
+    sleep 0.2
+    kill -USR1 $pid
+done
+cpu=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+kill $pid
+wait $pid
+check "exec probe: not hit by forwarded signals" test "$(runs "$tmp/probe")" -ge 2 -a -z "$(grep "failed its health check" "$tmp/probe.err")"
+check "exec probe: reaped without busy looping" test "$cpu" -lt 50
+./muinit \
+    --- @name=sick @health=exec:false @health-interval=100 @health-retries=2 sh -c "$record; sleep 30" "$tmp/sick" \
+    --- @name=well @listen=unix:"$tmp/health.sock" @health=unix:"$tmp/health.sock" @health-interval=100 sh -c "$record; sleep 30" "$tmp/well" \
+    2>"$tmp/health.err" &
+pid=$!
+sleep 1
+kill $pid
+wait $pid
+mapfile -t sick < <(gaps "$tmp/sick")
+check "health: failing command restarted" test "$(runs "$tmp/sick")" -ge 3
+check "health: restarted after its retries in a row" between "${sick[0]}" 200 450
+check "health: failure reported" grep -q "^sick failed its health check 2 times in a row" "$tmp/health.err"
+check "health: passing command kept running" test "$(runs "$tmp/well")" = 1
+
+echo "--- control socket"
+ctl() { # REQUEST..., prints the response and its exit status
+    local response
+    response=$(./muinitctl -c "$tmp/control.sock" "$@")
+    echo "$response $?"
+}
+valid_json() { # RESPONSE (as printed by ctl), only checked if python3 is available
+    ! command -v python3 >/dev/null || python3 -c 'import json, sys; json.loads(sys.argv[1].rsplit(" ", 1)[0])' "$1"
+}
+./muinit -o prefix -c "$tmp/control.sock" --- @name=a @replicas=2 test/test_child --timeout 30 --- @name=b test/test_child --timeout 30 >"$tmp/control.out" 2>&1 &
+pid=$!
+sleep 0.3
+response=$(ctl list)
+check "control list: all commands" test "$response" = '{"ok":true,"commands":[{"name":"a","replicas":2,"running":2,"ready":true},{"name":"b","replicas":1,"running":1,"ready":true}]} 0'
+check "control list: valid JSON" valid_json "$response"
+response=$(ctl status a 1)
+check "control status: one replica" grep -q '"instances":\[{"replica":1,"state":"running",.*} 0$' <<< "$response"
+check "control status: valid JSON" valid_json "$response"
+check "control scale" test "$(ctl scale a 3)" = '{"ok":true} 0'
+check "control stop" test "$(ctl stop a 0)" = '{"ok":true} 0'
+check "control signal" test "$(ctl signal USR1 b)" = '{"ok":true} 0'
+sleep 0.2
+response=$(ctl status a)
+check "control status: scaled up" grep -q '"replicas":3,"running":2,.*"replica":2,"state":"running"' <<< "$response"
+check "control status: stopped replica" grep -q '"replica":0,"state":"stopped"' <<< "$response"
+check "control signal: forwarded to the command" grep -q '^\[b [0-9]*\] child [0-9]*: received signal 10' "$tmp/control.out"
+check "control stop: muinit keeps running" kill -0 $pid
+response=$(ctl status nope)
+check "control: unknown command" test "$response" = '{"ok":false,"error":"unknown command"} 1'
+check "control: error is valid JSON" valid_json "$response"
+check "control: unknown replica" test "$(ctl stop a 7)" = '{"ok":false,"error":"unknown replica"} 1'
+check "control: unknown request" test "$(ctl bogus)" = '{"ok":false,"error":"invalid request"} 1'
+check "control: invalid count" test "$(ctl scale a x)" = '{"ok":false,"error":"invalid number of replicas"} 1'
+check "control: invalid signal" test "$(ctl signal NOSUCH b)" = '{"ok":false,"error":"invalid signal"} 1'
+check "control: too many arguments" test "$(ctl status a 0 1 2 3)" = '{"ok":false,"error":"too many arguments"} 1'
+./muinit -c "$tmp/control.sock" --- true 2>/dev/null
+check "control: socket in use is not taken over" test $? = 1 -a "$(ctl list | tail -c 2)" = 0
+kill $pid
+wait $pid
+check "control: socket removed at exit" test ! -e "$tmp/control.sock"
+./muinit -c "$tmp/control.sock" -k TERM -t 0.2 --- test/test_child --timeout 2 --ignore-sigterm 2>/dev/null &
+pid=$!
+sleep 0.2
+kill $pid
+wait $pid
+check "control: socket removed when children did not terminate in time" test $? = 1 -a ! -e "$tmp/control.sock"
+
+echo "--- config file"
+config_error() { # CONFIG EXPECTED_ERROR
+    printf "$1" > "$tmp/bad.conf"
+    ./muinit -f "$tmp/bad.conf" 2>"$tmp/bad.err"
+    [ $? = 1 ] && grep -qF "$2" "$tmp/bad.err"
+}
+check "config: setting outside of a section" config_error 'replicas = 2\n' "bad.conf:1: setting outside of a [NAME] section"
+check "config: line without =" config_error '[a]\ncommand\n' "bad.conf:2: expected KEY = VALUE"
+check "config: duplicate section" config_error '[a]\ncommand = true\n[a]\ncommand = true\n' "bad.conf:3: duplicate section [a]"
+check "config: section without command" config_error '[a]\nreplicas = 2\n[b]\ncommand = true\n' "bad.conf:3: no command given for a"
+check "config: command given twice" config_error '[a]\ncommand = true\ncommand = true\n' "bad.conf:3: command given twice"
+check "config: invalid command" config_error '[a]\ncommand = "true\n' "bad.conf:2: invalid command"
+check "config: invalid value" config_error '[a]\ncommand = true\nreplicas = x\n' "bad.conf:3: invalid setting"
+check "config: unknown setting" config_error '[a]\ncommand = true\nbogus = 1\n' "bad.conf:3: invalid setting"
+
+echo "--- config reload"
+pid_of() { # NAME REPLICA, of the running replica
+    ./muinitctl -c "$tmp/reload.sock" status "$1" "$2" | sed -n 's/.*"state":"running",.*"pid":\([0-9]*\).*/\1/p'
+}
+reload() { # CONFIG, written to the config file before sending SIGHUP
+    printf "$1" > "$tmp/reload.conf"
+    kill -HUP $pid
+    sleep 0.3
+}
+printf '[a]\ncommand = test/test_child --timeout 30\n[b]\ncommand = test/test_child --timeout 30\n' > "$tmp/reload.conf"
+./muinit -c "$tmp/reload.sock" -f "$tmp/reload.conf" 2>"$tmp/reload.err" &
+pid=$!
+sleep 0.3
+a=$(pid_of a 0)
+reload '[a]\ncommand = test/test_child --timeout 30\nreplicas = 2\n[b]\ncommand = test/test_child --timeout 30\n'
+check "reload: scaling adds replicas" grep -q '"name":"a","replicas":2,"running":2' <(./muinitctl -c "$tmp/reload.sock" list)
+check "reload: scaling keeps running replicas" test -n "$a" -a "$(pid_of a 0)" = "$a"
+reload '[a]\ncommand = test/test_child --timeout 31\nreplicas = 2\n[b]\ncommand = test/test_child --timeout 30\n'
+check "reload: changed command is replaced" test -n "$(pid_of a 0)" -a "$(pid_of a 0)" != "$a"
+check "reload: replacement runs all replicas" grep -q '"name":"a","replicas":2,"running":2' <(./muinitctl -c "$tmp/reload.sock" list)
+a=$(pid_of a 0)
+b=$(pid_of b 0)
+reload '[a]\ncommand = test/test_child --timeout 30\n[b]\nreplicas = 2\n'
+check "reload: invalid config is reported" grep -q "can't reload" "$tmp/reload.err"
+check "reload: invalid config keeps the commands" test "$(pid_of a 0)" = "$a" -a "$(pid_of b 0)" = "$b"
+reload '[a]\ncommand = test/test_child --timeout 31\nreplicas = 2\n[c]\ncommand = test/test_child --timeout 30\n'
+response=$(./muinitctl -c "$tmp/reload.sock" list)
+check "reload: removed command is stopped" test -z "$(grep '"name":"b"' <<< "$response")" -a -z "$(pid_of b 0)"
+check "reload: added command is started" grep -q '"name":"c","replicas":1,"running":1' <<< "$response"
+check "reload: unchanged command keeps running" test "$(pid_of a 0)" = "$a"
+kill $pid
+wait $pid
+
+echo "------------------"
+echo "$failures checks failed"
+[ $failures = 0 ]
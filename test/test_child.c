@@ -1,15 +1,69 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 static sigset_t set;
 
+/* with --shm, two values per replica: set once waiting for signals, and the CLOCK_MONOTONIC time in ns of the last signal */
+static uint64_t* shm_slot = NULL;
+
+static void open_shm(const char* path) {
+    const char* replica = getenv("MUINIT_REPLICA");
+    size_t index = replica ? atoi(replica) : 0;
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "child %d: can't open %s: %m\n", getpid(), path);
+        exit(1);
+    }
+    if ((index + 1) * 2 * sizeof(uint64_t) > (size_t)st.st_size) {
+        fprintf(stderr, "child %d: no slot for replica %zu in %s\n", getpid(), index, path);
+        exit(1);
+    }
+    uint64_t* slots = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (slots == MAP_FAILED) {
+        fprintf(stderr, "child %d: mmap failed: %m\n", getpid());
+        exit(1);
+    }
+    shm_slot = slots + 2 * index;
+}
+
+static void notify(const char* state) { /* sends an sd_notify(3) message to NOTIFY_SOCKET */
+    const char* path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "child %d: no usable NOTIFY_SOCKET\n", getpid());
+        exit(1);
+    }
+    memcpy(addr.sun_path, path, strlen(path));
+    if (addr.sun_path[0] == '@') { /* abstract socket */
+        addr.sun_path[0] = '\0';
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || sendto(fd, state, strlen(state), 0, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0) {
+        fprintf(stderr, "child %d: can't notify: %m\n", getpid());
+        exit(1);
+    }
+    close(fd);
+}
+
 static void spawn(char* const args[]) {
     pid_t mypid = getpid();
     int res = fork();
@@ -35,6 +89,8 @@ int main(int argc, char* argv[]) {
     int timeout = 0;
     int rc = 0;
     int ignore_sigterm = 0;
+    int stop_delay = 0;
+    int watchdog = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--rc") == 0) {
@@ -53,10 +109,46 @@ int main(int argc, char* argv[]) {
             ++i;
             continue;
         }
+        if (strcmp(argv[i], "--stop-delay") == 0) { /* in ms between receiving SIGTERM and exiting */
+            if (i >= argc - 1) {
+                fprintf(stderr, "child %d: wrong number of arguments\n", getpid());
+                return 1;
+            }
+            stop_delay = atoi(argv[i + 1]);
+            ++i;
+            continue;
+        }
         if (strcmp(argv[i], "--ignore-sigterm") == 0) {
             ignore_sigterm = 1;
             continue;
         }
+        if (strcmp(argv[i], "--shm") == 0) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "child %d: wrong number of arguments\n", getpid());
+                return 1;
+            }
+            open_shm(argv[i + 1]);
+            ++i;
+            continue;
+        }
+        if (strcmp(argv[i], "--notify") == 0) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "child %d: wrong number of arguments\n", getpid());
+                return 1;
+            }
+            notify(argv[i + 1]);
+            ++i;
+            continue;
+        }
+        if (strcmp(argv[i], "--watchdog") == 0) { /* in ms between sending WATCHDOG=1 while waiting for signals */
+            if (i >= argc - 1) {
+                fprintf(stderr, "child %d: wrong number of arguments\n", getpid());
+                return 1;
+            }
+            watchdog = atoi(argv[i + 1]);
+            ++i;
+            continue;
+        }
         if (strcmp(argv[i], "--exec") == 0) {
             spawn(&argv[i + 1]);
             return 0;
@@ -74,17 +166,38 @@ int main(int argc, char* argv[]) {
 
     int sig;
     alarm(timeout);
+    if (shm_slot) {
+        __atomic_store_n(&shm_slot[0], 1, __ATOMIC_RELEASE);
+    }
+    struct timespec interval = {watchdog / 1000, (watchdog % 1000) * 1000000L};
     while (1) {
-        if (sigwait(&set, &sig) != 0) {
+        if (watchdog) {
+            sig = sigtimedwait(&set, NULL, &interval);
+            if (sig < 0 && errno == EAGAIN) {
+                notify("WATCHDOG=1");
+                continue;
+            }
+            if (sig < 0) {
+                fprintf(stderr, "child %d: sigtimedwait failed: %m\n", getpid());
+                return -1;
+            }
+        } else if (sigwait(&set, &sig) != 0) {
             fprintf(stderr, "child %d: sigwait failed: %m\n", getpid());
             return -1;
         }
-        fprintf(stderr, "child %d: received signal %d: %s\n", getpid(), sig, strsignal(sig));
+        if (shm_slot) { /* timestamp only, as printing would distort the measurement */
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            __atomic_store_n(&shm_slot[1], (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, __ATOMIC_RELEASE);
+        } else {
+            fprintf(stderr, "child %d: received signal %d: %s\n", getpid(), sig, strsignal(sig));
+        }
         switch (sig) {
             case SIGALRM:
                 return rc;
             case SIGTERM:
                 if (!ignore_sigterm) {
+                    usleep(stop_delay * 1000);
                     return rc;
                 }
         }